@@ -0,0 +1,706 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// NOTE: developer builds only. --bench=DIR generates reproducible directories under DIR, then times
+// every stage of a listing on them for each format and sort, --bench-runs=N times each. Results are
+// tab separated, one line per stage, and --bench-compare=FILE adds the change against the results
+// of an earlier build. Included by lister.c after everything it times.
+
+#ifdef _WIN32
+#include <winioctl.h>
+#elif defined(__linux__)
+#include <sys/wait.h>
+#endif
+
+#define BENCH_VERSION 1
+
+enum {
+    BENCH_NAMES_SHORT,
+    BENCH_NAMES_LONG,
+    BENCH_NAMES_UNICODE,
+};
+
+typedef struct {
+    const char *name;
+    uint32_t files; // per directory
+    int depth; // 0 for a single directory
+    int fanout;
+    int names;
+} bench_dataset;
+
+static bench_dataset bench_datasets[] = {
+    {"flat", 1000000, 0, 0, BENCH_NAMES_SHORT},
+    {"deep", 16, 12, 2, BENCH_NAMES_SHORT},
+    {"long", 100000, 0, 0, BENCH_NAMES_LONG},
+    {"unicode", 100000, 0, 0, BENCH_NAMES_UNICODE},
+};
+
+// NOTE: only -D is timed on these, 11111 directories of 90 files is about a million entries to add up
+static bench_dataset bench_usage_datasets[] = {
+    {"tree-1m", 90, 4, 10, BENCH_NAMES_SHORT},
+};
+
+#ifdef __linux__
+// NOTE: --bench-dirents times only enumeration on these instead, readdir against the getdents64 reader
+static bench_dataset bench_dirent_datasets[] = {
+    {"dirents-10k", 10000, 0, 0, BENCH_NAMES_SHORT},
+    {"dirents-1m", 1000000, 0, 0, BENCH_NAMES_SHORT},
+    {"dirents-10m", 10000000, 0, 0, BENCH_NAMES_SHORT},
+};
+
+// NOTE: --bench-daemon lists these over and over, from --bench-clients threads at once
+static bench_dataset bench_daemon_datasets[] = {
+    {"daemon-1k", 1000, 0, 0, BENCH_NAMES_SHORT},
+    {"daemon-100k", 100000, 0, 0, BENCH_NAMES_SHORT},
+};
+#endif
+
+typedef struct {
+    const char *name;
+    int format;
+    int sort;
+    bool reverse;
+    bool unsorted;
+    bool disk_usage;
+} bench_config;
+
+static bench_config bench_configs[] = {
+    {.name = "", .format = FORMAT_WIDE, .sort = SORT_NAME},
+    {.name = "-r", .format = FORMAT_WIDE, .sort = SORT_NAME, .reverse = true},
+    {.name = "-X", .format = FORMAT_WIDE, .sort = SORT_EXTENSION},
+    {.name = "-t", .format = FORMAT_WIDE, .sort = SORT_TIME},
+    {.name = "-S", .format = FORMAT_WIDE, .sort = SORT_SIZE},
+    {.name = "-U", .format = FORMAT_WIDE, .sort = SORT_NAME, .unsorted = true},
+    {.name = "-l", .format = FORMAT_LONG, .sort = SORT_NAME},
+    {.name = "-lr", .format = FORMAT_LONG, .sort = SORT_NAME, .reverse = true},
+    {.name = "-lX", .format = FORMAT_LONG, .sort = SORT_EXTENSION},
+    {.name = "-lt", .format = FORMAT_LONG, .sort = SORT_TIME},
+    {.name = "-lS", .format = FORMAT_LONG, .sort = SORT_SIZE},
+    {.name = "-lU", .format = FORMAT_LONG, .sort = SORT_NAME, .unsorted = true},
+    {.name = "-D", .format = FORMAT_LONG, .sort = SORT_NAME, .disk_usage = true},
+};
+
+// NOTE: one line of an earlier run, keyed by everything but the numbers
+typedef struct {
+    char key[192];
+    uint64_t median;
+} bench_result;
+
+static bench_result *bench_baseline = NULL;
+static int bench_baseline_count = 0;
+
+#ifdef _WIN32
+bool bench_exists(char *path) {
+    return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+bool bench_make_dir(char *path) {
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// NOTE: sparse, so the sizes cost no disk space
+bool bench_make_file(char *path, uint64_t size, int64_t mtime) {
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD returned = 0;
+    DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)size;
+    bool made = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && SetEndOfFile(file);
+    uint64_t time = (uint64_t)(mtime + 11644473600ll) * 10000000ull;
+    FILETIME file_time = {(DWORD)time, (DWORD)(time >> 32)};
+    made = made && SetFileTime(file, NULL, NULL, &file_time);
+    CloseHandle(file);
+    return made;
+}
+#elif defined(__linux__)
+bool bench_exists(char *path) {
+    return access(path, F_OK) == 0;
+}
+
+bool bench_make_dir(char *path) {
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// NOTE: sparse, so the sizes cost no disk space
+bool bench_make_file(char *path, uint64_t size, int64_t mtime) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    struct timespec times[2] = {{(time_t)mtime, 0}, {(time_t)mtime, 0}};
+    bool made = ftruncate(fd, (off_t)size) == 0 && futimens(fd, times) == 0;
+    close(fd);
+    return made;
+}
+#endif
+
+// NOTE: splitmix64, every dataset starts from a fixed seed so the same tree comes out everywhere
+uint64_t bench_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static const char *bench_extensions[] = {"", ".c", ".h", ".txt", ".log", ".json", ".png", ".tar.gz", ".md", ".o"};
+static const char *bench_unicode[] = {"é", "ñ", "ü", "ß", "Ω", "π", "Ж", "д", "中", "文", "日", "本", "한", "글", "🙂", "a", "b", "c", "_"};
+
+// NOTE: a random prefix puts the names out of order, the index in base 36 keeps them unique.
+// A few get a space so quoting is exercised too.
+int bench_name(char *name, int size, uint64_t *state, int kind, uint32_t index) {
+    int length = 0;
+    int prefix = 0;
+    switch (kind) {
+    case BENCH_NAMES_SHORT: prefix = 4 + (int)(bench_random(state) % 10); break;
+    case BENCH_NAMES_LONG: prefix = 100 + (int)(bench_random(state) % 100); break;
+    case BENCH_NAMES_UNICODE: prefix = 4 + (int)(bench_random(state) % 16); break;
+    }
+    for (int i = 0; i < prefix; i++) {
+        if (kind == BENCH_NAMES_UNICODE) {
+            const char *piece = bench_unicode[bench_random(state) % (sizeof(bench_unicode) / sizeof(bench_unicode[0]))];
+            int piece_length = (int)strlen(piece);
+            memcpy(name + length, piece, piece_length);
+            length += piece_length;
+        } else {
+            name[length++] = "abcdefghijklmnopqrstuvwxyz0123456789_-"[bench_random(state) % 38];
+        }
+    }
+    if (bench_random(state) % 50 == 0) name[length++] = ' ';
+    name[length++] = '_';
+    char digits[8];
+    int digit_count = 0;
+    do {
+        digits[digit_count++] = "0123456789abcdefghijklmnopqrstuvwxyz"[index % 36];
+        index /= 36;
+    } while (index);
+    while (digit_count > 0) name[length++] = digits[--digit_count];
+    const char *extension = bench_extensions[bench_random(state) % (sizeof(bench_extensions) / sizeof(bench_extensions[0]))];
+    length += snprintf(name + length, size - length, "%s", extension);
+    return length;
+}
+
+// NOTE: sizes spread log-uniformly up to 16M, times over the three years before a fixed date
+bool bench_make_files(char *dir, uint32_t count, uint64_t *state, int kind) {
+    size_t dir_length = strlen(dir);
+    char *path = malloc(dir_length + 1024);
+    memcpy(path, dir, dir_length);
+    path[dir_length] = '/';
+    bool made = true;
+    for (uint32_t i = 0; made && i < count; i++) {
+        bench_name(path + dir_length + 1, 1000, state, kind, i);
+        uint64_t size = bench_random(state) % (1ull << (bench_random(state) % 25));
+        int64_t mtime = 1700000000 - (int64_t)(bench_random(state) % (3ull * 365 * 86400));
+        made = bench_make_file(path, size, mtime);
+    }
+    free(path);
+    return made;
+}
+
+bool bench_make_tree(char *dir, bench_dataset *dataset, int depth, uint64_t *state) {
+    if (!bench_make_dir(dir) || !bench_make_files(dir, dataset->files, state, dataset->names)) {
+        return false;
+    }
+    if (depth == 0) {
+        return true;
+    }
+    size_t dir_length = strlen(dir);
+    char *child = malloc(dir_length + 16);
+    bool made = true;
+    for (int i = 0; made && i < dataset->fanout; i++) {
+        snprintf(child, dir_length + 16, "%s/d%d", dir, i);
+        made = bench_make_tree(child, dataset, depth - 1, state);
+    }
+    free(child);
+    return made;
+}
+
+// NOTE: a dataset is only generated once, DIR/name.done marks a complete one
+bool bench_generate(bench_dataset *dataset, char *dir, char *done) {
+    if (bench_exists(done)) {
+        return true;
+    }
+    fprintf(stderr, "Lister: generating %s\n", dir);
+    uint64_t state = 0x6c69737465720000ull + BENCH_VERSION;
+    for (const char *c = dataset->name; *c; c++) state = state * 31 + (uint8_t)*c;
+    if (!bench_make_tree(dir, dataset, dataset->depth, &state)) {
+        return false;
+    }
+    FILE *file = fopen(done, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "%d\n", BENCH_VERSION);
+    return fclose(file) == 0;
+}
+
+int bench_compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_key(char *key, int size, bench_dataset *dataset, bench_config *config, const char *stage) {
+    snprintf(key, size, "%s\t%s\t%s", dataset->name, config->name[0] ? config->name : "-", stage);
+}
+
+bool bench_load_baseline(char *file_name) {
+    FILE *file = fopen(file_name, "r");
+    if (!file) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        char dataset[64], flags[16], stage[64];
+        unsigned long long median = 0;
+        if (line[0] == '#' || sscanf(line, "%63s %15s %63s %*s %*s %*s %llu", dataset, flags, stage, &median) != 4) {
+            continue;
+        }
+        bench_baseline = realloc(bench_baseline, (bench_baseline_count + 1) * sizeof(bench_result));
+        bench_result *result = &bench_baseline[bench_baseline_count++];
+        snprintf(result->key, sizeof(result->key), "%s\t%s\t%s", dataset, flags, stage);
+        result->median = median;
+    }
+    fclose(file);
+    return true;
+}
+
+// NOTE: dataset, flags, stage, entries (0 when timed as a whole), runs, min and median in nanoseconds,
+// the units (bytes or requests) of a run and units per second at the median when there are any, then
+// the baseline median and the change of the median when comparing
+void bench_report(out_buffer *out, bench_dataset *dataset, bench_config *config, const char *stage,
+                  uint64_t entries, uint64_t *samples, int count, uint64_t units) {
+    qsort(samples, count, sizeof(uint64_t), bench_compare_samples);
+    char key[192];
+    bench_key(key, sizeof(key), dataset, config, stage);
+    char line[512];
+    uint64_t median = samples[count / 2];
+    int length = snprintf(line, sizeof(line), "%s\t%llu\t%d\t%llu\t%llu", key, (unsigned long long)entries,
+                          count, (unsigned long long)samples[0], (unsigned long long)median);
+    out_write(out, line, length);
+    if (units) {
+        double rate = median ? (double)units * 1e9 / (double)median : 0.0;
+        length = snprintf(line, sizeof(line), "\t%llu\t%.0f", (unsigned long long)units, rate);
+        out_write(out, line, length);
+    }
+    for (int i = 0; bench_compare && i < bench_baseline_count; i++) {
+        if (strcmp(bench_baseline[i].key, key) != 0) continue;
+        uint64_t base = bench_baseline[i].median;
+        double change = base ? 100.0 * ((double)median - (double)base) / (double)base : 0.0;
+        length = snprintf(line, sizeof(line), "\t%llu\t%+.1f%%", (unsigned long long)base, change);
+        out_write(out, line, length);
+        break;
+    }
+    out_char(out, '\n');
+    out_flush(out);
+}
+
+void bench_use_config(bench_config *config, bool tree) {
+    print_format = config->format;
+    sort_file_type = config->sort;
+    reverse_order = config->reverse;
+    unsorted = config->unsorted;
+    disk_usage = config->disk_usage;
+    recursive = tree && !config->disk_usage;
+    print_dir_name = recursive;
+    all_files = false;
+    color_output = false;
+    limit_count = 0;
+}
+
+enum {
+    BENCH_SCAN,
+    BENCH_FILTER,
+    BENCH_SORT,
+    BENCH_PRINT,
+    BENCH_TOTAL,
+    BENCH_STAGES,
+};
+
+static const char *bench_stage_names[] = {
+    "xp_directory_scan", "filter_directory_files", "sort_directory_files", "print_directory", "total",
+};
+
+// NOTE: one directory through the same stages as a listing, output goes to memory and is dropped.
+// -U and -D are timed as a whole, their stages do not run one after the other.
+void bench_directory(out_buffer *out, bench_dataset *dataset, bench_config *config, xp_path path) {
+    uint64_t samples[BENCH_STAGES][BENCH_MAX_RUNS];
+    out_buffer sink = {0, 0, 0, -1};
+    uint64_t entries = 0;
+    bool staged = !config->unsorted && !config->disk_usage;
+
+    // NOTE: the first run only warms the caches
+    for (int run = -1; run < bench_runs; run++) {
+        uint64_t times[BENCH_STAGES + 1];
+        times[0] = xp_now_ns();
+        if (staged) {
+            xp_directory dir = {0};
+            xp_directory_scan_filtered(path, &dir, directory_scan_fields(), scan_filter(), NULL);
+            times[1] = xp_now_ns();
+            filter_directory_files(&dir);
+            times[2] = xp_now_ns();
+            sort_directory_files(&dir, sort_file_type);
+            times[3] = xp_now_ns();
+            print_directory(&sink, &dir);
+            times[4] = xp_now_ns();
+            entries = dir.order_count;
+            xp_directory_free(&dir);
+        } else if (config->unsorted) {
+            stream_directory(&sink, path);
+            times[4] = xp_now_ns();
+        } else {
+            walk_paths(&sink, &path, 1);
+            times[4] = xp_now_ns();
+        }
+        sink.count = 0;
+        if (run < 0) continue;
+        for (int stage = BENCH_SCAN; staged && stage <= BENCH_PRINT; stage++) {
+            samples[stage][run] = times[stage + 1] - times[stage];
+        }
+        samples[BENCH_TOTAL][run] = times[4] - times[0];
+    }
+    for (int stage = staged ? BENCH_SCAN : BENCH_TOTAL; stage < BENCH_STAGES; stage++) {
+        bench_report(out, dataset, config, bench_stage_names[stage], entries, samples[stage], bench_runs, 0);
+    }
+    free(sink.data);
+}
+
+#ifdef __linux__
+// NOTE: --bench-output times the print stage again, but through a real fd on /dev/null instead of into
+// memory, so the buffer flushes and write(2) calls are part of it. The bytes come from one render to memory.
+void bench_write(out_buffer *out, bench_dataset *dataset, bench_config *config, xp_path path) {
+    if (config->unsorted || config->disk_usage) return;
+    uint64_t samples[BENCH_MAX_RUNS];
+    xp_directory dir = {0};
+    xp_directory_scan_filtered(path, &dir, directory_scan_fields(), scan_filter(), NULL);
+    filter_directory_files(&dir);
+    sort_directory_files(&dir, sort_file_type);
+    out_buffer sink = {0, 0, 0, -1};
+    print_directory(&sink, &dir);
+    uint64_t bytes = (uint64_t)sink.count;
+    free(sink.data);
+
+    out_buffer null_out = {0, 0, 0, open("/dev/null", O_WRONLY | O_CLOEXEC)};
+    if (null_out.fd == -1) {
+        fprintf(stderr, "Lister: failed to open /dev/null\n");
+        xp_directory_free(&dir);
+        return;
+    }
+    for (int run = -1; run < bench_runs; run++) {
+        uint64_t start = xp_now_ns();
+        print_directory(&null_out, &dir);
+        out_flush(&null_out);
+        if (run >= 0) samples[run] = xp_now_ns() - start;
+    }
+    close(null_out.fd);
+    free(null_out.data);
+    bench_report(out, dataset, config, "write_dev_null", dir.order_count, samples, bench_runs, bytes);
+    xp_directory_free(&dir);
+}
+
+typedef struct {
+    xp_path path;
+    int requests;
+    bool daemon;
+    bool failed;
+} bench_client;
+
+// NOTE: one client, either asking the daemon like --client does or listing the path itself
+XT_PROC(bench_client_proc) {
+    bench_client *client = (bench_client *)data;
+    out_buffer sink = {0, 0, 0, -1};
+    for (int i = 0; i < client->requests; i++) {
+        if (client->daemon) {
+            client->failed |= client_list(&sink, &client->path, 1) != 1;
+        } else if (unsorted) {
+            client->failed |= !stream_directory(&sink, client->path);
+        } else {
+            xp_directory dir = {0};
+            if (list_directory(client->path, &dir)) print_directory(&sink, &dir);
+            else client->failed = true;
+            xp_directory_free(&dir);
+        }
+        sink.count = 0;
+    }
+    free(sink.data);
+    XT_PROC_RETURN;
+}
+
+// NOTE: every client makes the same number of requests, a run is timed until the last one is done
+bool bench_clients_run(xp_path path, bool daemon, int requests, uint64_t *elapsed) {
+    xt_thread threads[BENCH_MAX_CLIENTS];
+    bench_client clients[BENCH_MAX_CLIENTS];
+    uint64_t start = xp_now_ns();
+    for (int i = 0; i < bench_clients; i++) {
+        clients[i] = (bench_client){path, requests, daemon, false};
+        xt_thread_create(&threads[i], bench_client_proc, &clients[i]);
+    }
+    bool served = true;
+    for (int i = 0; i < bench_clients; i++) {
+        xt_thread_join(threads[i]);
+        served &= !clients[i].failed;
+    }
+    *elapsed = xp_now_ns() - start;
+    return served;
+}
+
+// NOTE: the same requests answered by the daemon and listed locally, both from every client at once
+bool bench_serve(out_buffer *out, bench_dataset *dataset, bench_config *config, xp_path path) {
+    if (config->disk_usage) return true;
+    int requests = (int)MAX(1, 100000 / dataset->files);
+    uint64_t total = (uint64_t)requests * bench_clients;
+    uint64_t samples[2][BENCH_MAX_RUNS];
+    for (int run = -1; run < bench_runs; run++) {
+        uint64_t local, served;
+        if (!bench_clients_run(path, false, requests, &local) || !bench_clients_run(path, true, requests, &served)) {
+            fprintf(stderr, "Lister: the daemon failed to list '%s'\n", path.data);
+            return false;
+        }
+        if (run < 0) continue;
+        samples[0][run] = local;
+        samples[1][run] = served;
+    }
+    char stage[64];
+    snprintf(stage, sizeof(stage), "local_clients=%d", bench_clients);
+    bench_report(out, dataset, config, stage, dataset->files, samples[0], bench_runs, total);
+    snprintf(stage, sizeof(stage), "daemon_clients=%d", bench_clients);
+    bench_report(out, dataset, config, stage, dataset->files, samples[1], bench_runs, total);
+    return true;
+}
+
+// NOTE: the daemon gets its own socket under DIR/daemon through XDG_RUNTIME_DIR. It is forked before
+// this process lists anything, so the child does not inherit a stat pool whose threads it lacks.
+pid_t bench_daemon_start() {
+    char *base = realpath(bench_dir, NULL);
+    if (!base) {
+        return -1;
+    }
+    char runtime[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int length = snprintf(runtime, sizeof(runtime) - 16, "%s/daemon", base);
+    free(base);
+    if (length < 0 || length >= (int)sizeof(runtime) - 16) {
+        fprintf(stderr, "Lister: '%s' is too long a path for the daemon socket\n", bench_dir);
+        return -1;
+    }
+    mkdir(runtime, 0700);
+    setenv("XDG_RUNTIME_DIR", runtime, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(run_daemon() ? 0 : 1);
+    }
+
+    struct sockaddr_un address;
+    daemon_socket_path(&address);
+    for (int attempt = 0; pid > 0 && attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool listening = connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(fd);
+        if (listening) return pid;
+        usleep(10000);
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return -1;
+}
+#endif
+
+// NOTE: trees are listed with -R (or -D) as a whole, through the walker
+void bench_tree(out_buffer *out, bench_dataset *dataset, bench_config *config, xp_path path) {
+    if (config->unsorted) return;
+    uint64_t samples[BENCH_MAX_RUNS];
+    out_buffer sink = {0, 0, 0, -1};
+    for (int run = -1; run < bench_runs; run++) {
+        uint64_t start = xp_now_ns();
+        walk_paths(&sink, &path, 1);
+        if (run >= 0) samples[run] = xp_now_ns() - start;
+        sink.count = 0;
+    }
+    bench_report(out, dataset, config, "walk_paths", 0, samples, bench_runs, 0);
+    free(sink.data);
+}
+
+#ifdef __linux__
+// NOTE: names only, the reads of either side are the whole cost. Returns how many entries there were.
+uint64_t bench_readdir(char *path) {
+    uint64_t entries = 0;
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    while (readdir(dir)) entries++;
+    closedir(dir);
+    return entries;
+}
+
+uint64_t bench_getdents(char *path) {
+    uint64_t entries = 0;
+    xp_dirent_reader reader;
+    if (!xp_dirent_reader_open(&reader, path)) {
+        xp_dirent_reader_close(&reader);
+        return 0;
+    }
+    while (xp_dirent_next(&reader)) entries++;
+    xp_dirent_reader_close(&reader);
+    return entries;
+}
+
+void bench_enumerate(out_buffer *out, bench_dataset *dataset, char *path) {
+    static bench_config config = {.name = ""};
+    uint64_t samples[2][BENCH_MAX_RUNS];
+    uint64_t entries = 0;
+    // NOTE: the two take turns going first, so neither always finds the caches the other left
+    for (int run = -1; run < bench_runs; run++) {
+        uint64_t times[3];
+        bool first = run & 1;
+        times[0] = xp_now_ns();
+        entries = first ? bench_readdir(path) : bench_getdents(path);
+        times[1] = xp_now_ns();
+        if (first) bench_getdents(path);
+        else bench_readdir(path);
+        times[2] = xp_now_ns();
+        if (run < 0) continue;
+        samples[0][run] = times[first ? 1 : 2] - times[first ? 0 : 1];
+        samples[1][run] = times[first ? 2 : 1] - times[first ? 1 : 0];
+    }
+    bench_report(out, dataset, &config, "readdir", entries, samples[0], bench_runs, 0);
+    bench_report(out, dataset, &config, "getdents64", entries, samples[1], bench_runs, 0);
+}
+#endif
+
+// NOTE: DIR/name and DIR/name.done for a dataset, the path made absolute
+bool bench_prepare(bench_dataset *dataset, char **dir, xp_path *path) {
+    size_t dir_length = strlen(bench_dir);
+    char *done = malloc(dir_length + 64);
+    *dir = malloc(dir_length + 64);
+    snprintf(*dir, dir_length + 64, "%s/%s", bench_dir, dataset->name);
+    snprintf(done, dir_length + 64, "%s/%s.done", bench_dir, dataset->name);
+    bool generated = bench_generate(dataset, *dir, done);
+    free(done);
+    if (!generated) {
+        fprintf(stderr, "Lister: failed to generate '%s'\n", *dir);
+        free(*dir);
+        return false;
+    }
+    *path = xp_path_new(*dir);
+    if (xp_path_relative(*path)) {
+        xp_path full_path = xp_fullpath(*path);
+        xp_path_free(path);
+        *path = full_path;
+    }
+    return true;
+}
+
+bool run_bench(out_buffer *out) {
+    if (bench_compare && !bench_load_baseline(bench_compare)) {
+        fprintf(stderr, "Lister: failed to read benchmark results '%s'\n", bench_compare);
+        return false;
+    }
+    if (!bench_make_dir(bench_dir)) {
+        fprintf(stderr, "Lister: failed to create '%s'\n", bench_dir);
+        return false;
+    }
+
+    out_string(out, "# dataset\tflags\tstage\tentries\truns\tmin_ns\tmedian_ns");
+#ifdef __linux__
+    if (bench_output) out_string(out, "\tbytes\tbytes_per_s");
+    else if (bench_daemon) out_string(out, "\trequests\trequests_per_s");
+#endif
+    if (bench_compare) out_string(out, "\tbase_median_ns\tchange");
+    out_char(out, '\n');
+
+#ifdef __linux__
+    if (bench_dirents) {
+        for (size_t i = 0; i < sizeof(bench_dirent_datasets) / sizeof(bench_dirent_datasets[0]); i++) {
+            char *dir;
+            xp_path path;
+            if (!bench_prepare(&bench_dirent_datasets[i], &dir, &path)) {
+                return false;
+            }
+            bench_enumerate(out, &bench_dirent_datasets[i], (char *)path.data);
+            xp_path_free(&path);
+            free(dir);
+        }
+        return true;
+    }
+    if (bench_daemon) {
+        pid_t daemon = bench_daemon_start();
+        if (daemon == -1) {
+            fprintf(stderr, "Lister: failed to start the daemon\n");
+            return false;
+        }
+        bool served = true;
+        for (size_t i = 0; served && i < sizeof(bench_daemon_datasets) / sizeof(bench_daemon_datasets[0]); i++) {
+            bench_dataset *dataset = &bench_daemon_datasets[i];
+            char *dir;
+            xp_path path;
+            if (!bench_prepare(dataset, &dir, &path)) {
+                served = false;
+                break;
+            }
+            for (size_t j = 0; served && j < sizeof(bench_configs) / sizeof(bench_configs[0]); j++) {
+                bench_use_config(&bench_configs[j], false);
+                served = bench_serve(out, dataset, &bench_configs[j], path);
+            }
+            xp_path_free(&path);
+            free(dir);
+        }
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+        return served;
+    }
+    if (bench_output) {
+        for (size_t i = 0; i < sizeof(bench_datasets) / sizeof(bench_datasets[0]); i++) {
+            bench_dataset *dataset = &bench_datasets[i];
+            char *dir;
+            xp_path path;
+            if (dataset->depth > 0) continue;
+            if (!bench_prepare(dataset, &dir, &path)) {
+                return false;
+            }
+            for (size_t j = 0; j < sizeof(bench_configs) / sizeof(bench_configs[0]); j++) {
+                bench_use_config(&bench_configs[j], false);
+                bench_write(out, dataset, &bench_configs[j], path);
+            }
+            xp_path_free(&path);
+            free(dir);
+        }
+        return true;
+    }
+#endif
+    for (size_t i = 0; i < sizeof(bench_datasets) / sizeof(bench_datasets[0]); i++) {
+        bench_dataset *dataset = &bench_datasets[i];
+        char *dir;
+        xp_path path;
+        if (!bench_prepare(dataset, &dir, &path)) {
+            return false;
+        }
+        for (size_t j = 0; j < sizeof(bench_configs) / sizeof(bench_configs[0]); j++) {
+            bench_config *config = &bench_configs[j];
+            bench_use_config(config, dataset->depth > 0);
+            if (dataset->depth > 0) bench_tree(out, dataset, config, path);
+            else bench_directory(out, dataset, config, path);
+        }
+        xp_path_free(&path);
+        free(dir);
+    }
+    for (size_t i = 0; i < sizeof(bench_usage_datasets) / sizeof(bench_usage_datasets[0]); i++) {
+        bench_dataset *dataset = &bench_usage_datasets[i];
+        char *dir;
+        xp_path path;
+        if (!bench_prepare(dataset, &dir, &path)) {
+            return false;
+        }
+        for (size_t j = 0; j < sizeof(bench_configs) / sizeof(bench_configs[0]); j++) {
+            if (!bench_configs[j].disk_usage) continue;
+            bench_use_config(&bench_configs[j], true);
+            bench_tree(out, dataset, &bench_configs[j], path);
+        }
+        xp_path_free(&path);
+        free(dir);
+    }
+    return true;
+}
+
+#endif // BENCH_H
@@ -1,10 +1,14 @@
+#ifdef __linux__
+// NOTE: struct ucred for SO_PEERCRED
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
-#include <stdarg.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -12,9 +16,60 @@
 #endif
 #ifdef __linux__
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef LISTER_STATS
+// NOTE: --stats, only in builds with -DLISTER_STATS. Workers all add to the same counters so the adds are
+// atomic, and phase times are summed over threads, under -R they can add up to more than the wall clock.
+typedef struct {
+    uint64_t start_ns;
+    uint64_t fullpath_ns;
+    uint64_t enumerate_ns;
+    uint64_t stat_ns;
+    uint64_t filter_ns;
+    uint64_t sort_ns;
+    uint64_t render_ns;
+    uint64_t write_ns;
+    uint64_t dir_opens;
+    uint64_t dir_reads;
+    uint64_t stat_calls;
+    uint64_t uring_calls;
+    uint64_t uring_stats;
+    uint64_t write_calls;
+    uint64_t allocations;
+    uint64_t entries_seen;
+    uint64_t entries_shown;
+    uint64_t bytes_written;
+} lister_stats;
+
+static lister_stats stats;
+
+#ifdef _WIN32
+#define STATS_ADD(counter, n) InterlockedExchangeAdd64((volatile LONG64 *)&stats.counter, (LONG64)(n))
+#else
+#define STATS_ADD(counter, n) __atomic_fetch_add(&stats.counter, (uint64_t)(n), __ATOMIC_RELAXED)
+#endif
+#define STATS_BEGIN(phase) uint64_t phase##_begin = xp_now_ns()
+#define STATS_END(phase) STATS_ADD(phase##_ns, xp_now_ns() - phase##_begin)
+
+#define XP_COUNT(counter, n) STATS_ADD(counter, n)
+#define XP_PHASE_BEGIN(phase) STATS_BEGIN(phase)
+#define XP_PHASE_END(phase) STATS_END(phase)
+#else
+#define STATS_ADD(counter, n) ((void)(n))
+#define STATS_BEGIN(phase) ((void)0)
+#define STATS_END(phase) ((void)0)
 #endif
 
 #include "xpath.h"
+#include "xthread.h"
 
 #define KB(N) (1000 *   (N))
 #define MB(N) (1000 * KB(N))
@@ -23,6 +78,8 @@
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
 
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
 enum {
     FORMAT_WIDE,
     FORMAT_LONG,
@@ -32,6 +89,7 @@ enum {
     SORT_NAME,
     SORT_EXTENSION,
     SORT_TIME,
+    SORT_SIZE,
 };
 
 static xp_path *paths = NULL;
@@ -44,14 +102,382 @@ static int print_dir_name = false;
 static int print_format = FORMAT_WIDE;
 static int sort_file_type = SORT_NAME;
 static bool all_files = false;
+static bool reverse_order = false;
+static int limit_count = 0;
+static bool unsorted = false;
+static bool recursive = false;
+static bool disk_usage = false;
+static bool use_cache = false;
+static bool watch_mode = false;
+static bool daemon_mode = false;
+static bool client_mode = false;
+static char *snapshot_file = NULL;
+static char *diff_file = NULL;
+static uint64_t memory_budget = 0;
+#ifdef DEVELOPER
+// NOTE: --bench, see bench.h
+#define BENCH_MAX_RUNS 64
+#define BENCH_MAX_CLIENTS 256
+static char *bench_dir = NULL;
+static char *bench_compare = NULL;
+static int bench_runs = 5;
+static bool bench_dirents = false;
+static bool bench_output = false;
+static bool bench_daemon = false;
+static int bench_clients = 8;
+#endif
+static char *cache_dir = NULL;
+static bool color_output = false;
+
+static const char color_directory[] = "\x1b[38;2;0;132;212m";
+static const char color_executable[] = "\x1b[38;2;86;219;58m";
+static const char color_reset[] = "\x1b[0m";
+
+// NOTE: everything printed goes through one of these, with fd -1 the buffer just grows in memory
+typedef struct {
+    char *data;
+    int count;
+    int cap;
+    int fd;
+} out_buffer;
+
+static out_buffer output = {0, 0, 0, 1};
+
+void out_write_fd(int fd, const char *data, size_t size) {
+    STATS_BEGIN(write);
+#ifdef _WIN32
+    HANDLE handle = GetStdHandle(STD_OUTPUT_HANDLE);
+    while (size > 0) {
+        DWORD written = 0;
+        STATS_ADD(write_calls, 1);
+        if (!WriteFile(handle, data, (DWORD)size, &written, NULL)) break;
+        STATS_ADD(bytes_written, written);
+        data += written;
+        size -= written;
+    }
+#elif defined(__linux__)
+    while (size > 0) {
+        STATS_ADD(write_calls, 1);
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) break;
+        STATS_ADD(bytes_written, written);
+        data += written;
+        size -= written;
+    }
+#endif
+    STATS_END(write);
+}
+
+void out_flush(out_buffer *out) {
+    if (out->fd < 0) return;
+    out_write_fd(out->fd, out->data, out->count);
+    out->count = 0;
+}
+
+void out_reserve(out_buffer *out, int size) {
+    if (out->count + size <= out->cap) return;
+    if (out->fd >= 0 && out->cap >= size) {
+        out_flush(out);
+        return;
+    }
+    int cap = out->cap ? out->cap : OUTPUT_BUFFER_SIZE;
+    while (cap < out->count + size) cap *= 2;
+    out->data = realloc(out->data, cap);
+    out->cap = cap;
+    STATS_ADD(allocations, 1);
+}
+
+void out_write(out_buffer *out, const char *data, int size) {
+    // NOTE: empty spans come with a NULL data, and an empty buffer has none either
+    if (size <= 0) return;
+#ifdef __linux__
+    // NOTE: spans larger than the buffer go out together with what is buffered in one writev
+    if (out->fd >= 0 && size > OUTPUT_BUFFER_SIZE) {
+        struct iovec spans[2] = {{out->data, (size_t)out->count}, {(void *)data, (size_t)size}};
+        STATS_BEGIN(write);
+        ssize_t written = writev(out->fd, spans, 2);
+        STATS_END(write);
+        STATS_ADD(write_calls, 1);
+        if (written < 0) written = 0;
+        STATS_ADD(bytes_written, written);
+        if (written < out->count) {
+            out_write_fd(out->fd, out->data + written, out->count - written);
+            written = out->count;
+        }
+        out_write_fd(out->fd, data + (written - out->count), size - (written - out->count));
+        out->count = 0;
+        return;
+    }
+#endif
+    out_reserve(out, size);
+    memcpy(out->data + out->count, data, size);
+    out->count += size;
+}
+
+void out_char(out_buffer *out, char c) {
+    out_reserve(out, 1);
+    out->data[out->count++] = c;
+}
+
+void out_string(out_buffer *out, const char *str) {
+    out_write(out, str, (int)strlen(str));
+}
+
+void out_pad(out_buffer *out, int count) {
+    static const char spaces[] = "                                                                ";
+    while (count > 0) {
+        int n = MIN(count, (int)sizeof(spaces) - 1);
+        out_write(out, spaces, n);
+        count -= n;
+    }
+}
+
+// NOTE: right aligned in width, padded with pad
+void out_uint(out_buffer *out, uint64_t value, int width, char pad) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    for (; count < width; count++) {
+        digits[sizeof(digits) - 1 - count] = pad;
+    }
+    out_write(out, digits + sizeof(digits) - count, count);
+}
+
+#ifdef LISTER_STATS
+void stats_print() {
+    out_flush(&output);
+    double ms = 1e-6;
+    fprintf(stderr, "Lister stats (ms, summed over threads)\n");
+    fprintf(stderr, "  total      %10.3f\n", (xp_now_ns() - stats.start_ns) * ms);
+    fprintf(stderr, "  fullpath   %10.3f\n", stats.fullpath_ns * ms);
+    fprintf(stderr, "  enumerate  %10.3f\n", stats.enumerate_ns * ms);
+    fprintf(stderr, "  stat       %10.3f\n", stats.stat_ns * ms);
+    fprintf(stderr, "  filter     %10.3f\n", stats.filter_ns * ms);
+    fprintf(stderr, "  sort       %10.3f\n", stats.sort_ns * ms);
+    fprintf(stderr, "  render     %10.3f\n", stats.render_ns * ms);
+    fprintf(stderr, "  write      %10.3f\n", stats.write_ns * ms);
+    fprintf(stderr, "Calls\n");
+    fprintf(stderr, "  dir open   %10llu\n", (unsigned long long)stats.dir_opens);
+    fprintf(stderr, "  dir read   %10llu\n", (unsigned long long)stats.dir_reads);
+    fprintf(stderr, "  stat       %10llu\n", (unsigned long long)stats.stat_calls);
+    fprintf(stderr, "  io_uring   %10llu (%llu stats)\n", (unsigned long long)stats.uring_calls, (unsigned long long)stats.uring_stats);
+    fprintf(stderr, "  write      %10llu\n", (unsigned long long)stats.write_calls);
+    fprintf(stderr, "  alloc      %10llu\n", (unsigned long long)stats.allocations);
+    fprintf(stderr, "Entries\n");
+    fprintf(stderr, "  seen       %10llu\n", (unsigned long long)stats.entries_seen);
+    fprintf(stderr, "  shown      %10llu\n", (unsigned long long)stats.entries_shown);
+    fprintf(stderr, "  bytes      %10llu\n", (unsigned long long)stats.bytes_written);
+}
+#endif
+
+// NOTE: N with an optional K, M or G suffix, sizes are 1000 based like the listing
+bool parse_number(char *text, uint64_t *value, bool suffixes) {
+    if (*text < '0' || *text > '9') return false;
+    char *end = NULL;
+    *value = strtoull(text, &end, 10);
+    if (suffixes) {
+        switch (*end) {
+        case 'K': case 'k': *value = KB(*value); end++; break;
+        case 'M': case 'm': *value = MB(*value); end++; break;
+        case 'G': case 'g': *value = GB(*value); end++; break;
+        }
+    }
+    return *end == '\0';
+}
+
+// NOTE: --include/--ignore patterns are compiled to the cheapest test that accepts the same names
+enum {
+    GLOB_LITERAL,
+    GLOB_PREFIX, // "name*"
+    GLOB_SUFFIX, // "*.ext"
+    GLOB_GENERAL,
+};
+
+typedef struct {
+    int kind;
+    char *text; // the fixed part, or the whole pattern for GLOB_GENERAL
+    int length;
+} glob_pattern;
+
+// NOTE: every predicate from the command line, entries have to pass all of them
+typedef struct {
+    glob_pattern *include;
+    int include_count;
+    glob_pattern *ignore;
+    int ignore_count;
+    char size_compare; // '+' larger, '-' smaller, '=' exactly, 0 unused
+    uint64_t size;
+    char mtime_compare;
+    int64_t mtime_days;
+    char type; // 'f', 'd', 'l' or 0
+    int64_t now;
+} file_matcher;
+
+static file_matcher matcher;
+static bool matcher_active = false;
+
+bool glob_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+glob_pattern glob_compile(char *pattern) {
+    glob_pattern glob = {GLOB_GENERAL, pattern, (int)strlen(pattern)};
+    int specials = 0;
+    for (int i = 0; i < glob.length; i++) {
+        if (glob_special(pattern[i])) specials++;
+    }
+    if (specials == 0) {
+        glob.kind = GLOB_LITERAL;
+    } else if (specials == 1 && pattern[0] == '*') {
+        glob.kind = GLOB_SUFFIX;
+        glob.text = pattern + 1;
+        glob.length--;
+    } else if (specials == 1 && pattern[glob.length - 1] == '*') {
+        glob.kind = GLOB_PREFIX;
+        glob.length--;
+    }
+    return glob;
+}
+
+// NOTE: [set] with ranges and a leading '!' or '^', returns the pattern past the set or NULL when c is not in it
+char *glob_match_set(char *pattern, char c) {
+    bool negate = *pattern == '!' || *pattern == '^';
+    if (negate) pattern++;
+    bool found = false;
+    bool first = true;
+    while (*pattern && (first || *pattern != ']')) {
+        char low = *pattern++;
+        char high = low;
+        if (*pattern == '-' && pattern[1] && pattern[1] != ']') {
+            high = pattern[1];
+            pattern += 2;
+        }
+        if (c >= low && c <= high) found = true;
+        first = false;
+    }
+    if (*pattern != ']') return NULL;
+    return found != negate ? pattern + 1 : NULL;
+}
+
+// NOTE: shell style *, ? and [set], backtracking only to the last star
+bool glob_match(char *pattern, char *name) {
+    char *star = NULL;
+    char *star_name = NULL;
+    while (*name) {
+        char *next = NULL;
+        if (*pattern == '*') {
+            star = ++pattern;
+            star_name = name;
+            continue;
+        } else if (*pattern == '?') {
+            next = pattern + 1;
+        } else if (*pattern == '[') {
+            next = glob_match_set(pattern + 1, *name);
+        } else if (*pattern == '\\' && pattern[1]) {
+            if (pattern[1] == *name) next = pattern + 2;
+        } else if (*pattern && *pattern == *name) {
+            next = pattern + 1;
+        }
+
+        if (next) {
+            pattern = next;
+            name++;
+        } else if (star) {
+            pattern = star;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+bool glob_matches(glob_pattern *glob, char *name, int length) {
+    switch (glob->kind) {
+    case GLOB_LITERAL: return length == glob->length && memcmp(name, glob->text, length) == 0;
+    case GLOB_PREFIX: return length >= glob->length && memcmp(name, glob->text, glob->length) == 0;
+    case GLOB_SUFFIX: return length >= glob->length && memcmp(name + length - glob->length, glob->text, glob->length) == 0;
+    }
+    return glob_match(glob->text, name);
+}
+
+bool matcher_any(glob_pattern *globs, int count, char *name, int length) {
+    for (int i = 0; i < count; i++) {
+        if (glob_matches(&globs[i], name, length)) return true;
+    }
+    return false;
+}
+
+bool matcher_type(uint32_t attributes) {
+    switch (matcher.type) {
+    case 'd': return (attributes & XP_DIRECTORY) && !(attributes & XP_LINK);
+    case 'l': return (attributes & XP_LINK) != 0;
+#ifdef _WIN32
+    // NOTE: XP_NORMAL is FILE_ATTRIBUTE_NORMAL on Windows, which any other attribute clears
+    case 'f': return !(attributes & (XP_DIRECTORY | XP_LINK));
+#else
+    // NOTE: like find -type f, fifos, sockets and devices are not files
+    case 'f': return (attributes & XP_NORMAL) && !(attributes & XP_LINK);
+#endif
+    }
+    return true;
+}
+
+// NOTE: directories of a recursive listing are kept so the walk can go through them,
+// only --ignore takes them out
+bool matcher_name(char *name, int length, uint32_t attributes, bool type_known) {
+    if (matcher_any(matcher.ignore, matcher.ignore_count, name, length)) return false;
+    if (recursive && (!type_known || ((attributes & XP_DIRECTORY) && !(attributes & XP_LINK)))) return true;
+    if (matcher.include_count && !matcher_any(matcher.include, matcher.include_count, name, length)) return false;
+    return !type_known || matcher_type(attributes);
+}
+
+// NOTE: runs in the scanner before anything is stat'd, the type is only known when the directory
+// listing had it (attributes 0 means it did not)
+bool matcher_filter(char *name, uint32_t attributes, void *user) {
+    (void)user;
+    return matcher_name(name, (int)strlen(name), attributes, attributes != 0);
+}
+
+bool matcher_compare(char compare, int64_t value, int64_t limit) {
+    switch (compare) {
+    case '+': return value > limit;
+    case '-': return value < limit;
+    case '=': return value == limit;
+    }
+    return true;
+}
+
+// NOTE: the whole matcher on a scanned entry, anything the scanner let through undecided is settled here
+bool file_matches(const xp_directory *dir, uint32_t index) {
+    if (!matcher_active) return true;
+    uint32_t attributes = dir->attributes[index];
+    if (!matcher_name(xp_file_name(dir, index), dir->name_lengths[index], attributes, true)) return false;
+    if (recursive && (attributes & XP_DIRECTORY) && !(attributes & XP_LINK)) return true;
+    if (matcher.size_compare && !matcher_compare(matcher.size_compare, (int64_t)dir->sizes[index], (int64_t)matcher.size)) return false;
+    if (matcher.mtime_compare) {
+        int64_t age = (matcher.now - xp_unix_time(dir->times[index])) / 86400;
+        if (!matcher_compare(matcher.mtime_compare, age, matcher.mtime_days)) return false;
+    }
+    return true;
+}
+
+void matcher_add_glob(glob_pattern **globs, int *count, char *pattern) {
+    *globs = realloc(*globs, (*count + 1) * sizeof(glob_pattern));
+    (*globs)[(*count)++] = glob_compile(pattern);
+    matcher_active = true;
+}
 
-void cprint(int r, int g, int b, const char *fmt, ...) {
-    printf("\x1b[38;2;%d;%d;%dm", r, g, b);
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    printf("\x1b[0m");
+// NOTE: [+|-]N, compared as larger, smaller or exactly N
+bool matcher_parse_number(char *text, char *compare, uint64_t *value, bool suffixes) {
+    *compare = '=';
+    if (*text == '+' || *text == '-') *compare = *text++;
+    matcher_active = true;
+    return parse_number(text, value, suffixes);
 }
 
 void parse_arg(char *arg) {
@@ -69,6 +495,26 @@ void parse_arg(char *arg) {
         case 'X':
             sort_file_type = SORT_EXTENSION;
             break;
+        case 'S':
+            sort_file_type = SORT_SIZE;
+            break;
+        case 'r':
+            reverse_order = true;
+            break;
+        case 'U':
+            unsorted = true;
+            break;
+        case 'f':
+            unsorted = true;
+            all_files = true;
+            break;
+        case 'R':
+            recursive = true;
+            break;
+        case 'D':
+            disk_usage = true;
+            print_format = FORMAT_LONG;
+            break;
         default:
             fprintf(stderr, "Lister: unknown option '%c'\n", *arg);
             exit(0);
@@ -76,301 +522,3221 @@ void parse_arg(char *arg) {
     }
 }
 
-void process_args(int argc, char **argv) {
-    for (int i = 0; i < argc; i++) {
-        char *arg = argv[i];
-        if (arg[0] == '-') {
-            parse_arg(arg);
+void parse_long_arg(char *arg) {
+    if (strncmp(arg, "--limit=", 8) == 0) {
+        limit_count = atoi(arg + 8);
+        if (limit_count <= 0) {
+            fprintf(stderr, "Lister: invalid limit '%s'\n", arg + 8);
+            exit(0);
         }
-    }
-}
-
-int get_name_length(char *name) {
-    // TODO: handle quotes, non-printable characters, special characters
-    int length = 0;
-    bool spaces = false;
-    for (char *ptr = name; *ptr; ptr++) {
-        switch (*ptr) {
-        case ' ':
-            length++;
-            spaces = true;
-            break;
-        default:
-            length++;
+    } else if (strncmp(arg, "--include=", 10) == 0) {
+        matcher_add_glob(&matcher.include, &matcher.include_count, arg + 10);
+    } else if (strncmp(arg, "--ignore=", 9) == 0) {
+        matcher_add_glob(&matcher.ignore, &matcher.ignore_count, arg + 9);
+    } else if (strncmp(arg, "--size=", 7) == 0) {
+        if (!matcher_parse_number(arg + 7, &matcher.size_compare, &matcher.size, true)) {
+            fprintf(stderr, "Lister: invalid size '%s'\n", arg + 7);
+            exit(0);
+        }
+    } else if (strncmp(arg, "--mtime=", 8) == 0) {
+        uint64_t days = 0;
+        if (!matcher_parse_number(arg + 8, &matcher.mtime_compare, &days, false)) {
+            fprintf(stderr, "Lister: invalid age '%s'\n", arg + 8);
+            exit(0);
+        }
+        matcher.mtime_days = (int64_t)days;
+        matcher.now = (int64_t)time(NULL);
+    } else if (strncmp(arg, "--type=", 7) == 0) {
+        matcher.type = arg[7];
+        if ((matcher.type != 'f' && matcher.type != 'd' && matcher.type != 'l') || arg[8]) {
+            fprintf(stderr, "Lister: invalid type '%s'\n", arg + 7);
+            exit(0);
+        }
+        matcher_active = true;
+    } else if (strcmp(arg, "--cache") == 0) {
+        use_cache = true;
+    } else if (strcmp(arg, "--watch") == 0) {
+        watch_mode = true;
+    } else if (strcmp(arg, "--daemon") == 0) {
+        daemon_mode = true;
+    } else if (strcmp(arg, "--client") == 0) {
+        client_mode = true;
+    } else if (strncmp(arg, "--memory=", 9) == 0) {
+        if (!parse_number(arg + 9, &memory_budget, true) || memory_budget < MB(1)) {
+            fprintf(stderr, "Lister: invalid memory budget '%s', at least 1M\n", arg + 9);
+            exit(0);
         }
+#ifdef DEVELOPER
+    } else if (strncmp(arg, "--bench=", 8) == 0) {
+        bench_dir = arg + 8;
+    } else if (strncmp(arg, "--bench-compare=", 16) == 0) {
+        bench_compare = arg + 16;
+    } else if (strncmp(arg, "--bench-runs=", 13) == 0) {
+        bench_runs = MAX(1, MIN(BENCH_MAX_RUNS, atoi(arg + 13)));
+    } else if (strcmp(arg, "--bench-dirents") == 0) {
+        bench_dirents = true;
+    } else if (strcmp(arg, "--bench-output") == 0) {
+        bench_output = true;
+    } else if (strcmp(arg, "--bench-daemon") == 0) {
+        bench_daemon = true;
+    } else if (strncmp(arg, "--bench-clients=", 16) == 0) {
+        bench_clients = MAX(1, MIN(BENCH_MAX_CLIENTS, atoi(arg + 16)));
+#endif
+#ifdef LISTER_STATS
+    } else if (strcmp(arg, "--stats") == 0) {
+        stats.start_ns = xp_now_ns();
+        atexit(stats_print);
+#endif
+    } else if (strncmp(arg, "--snapshot=", 11) == 0) {
+        snapshot_file = arg + 11;
+    } else if (strncmp(arg, "--diff=", 7) == 0) {
+        diff_file = arg + 7;
+    } else {
+        fprintf(stderr, "Lister: unknown option '%s'\n", arg);
+        exit(0);
     }
-    // add space for quotes
-    if (spaces) length += 2;
-
-    return length;
 }
 
-int has_spaces(char *name) {
-    for (char *ptr = name; *ptr; ptr++) {
-        if (*ptr == ' ') return true;
+void process_args(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] == '-') {
+            parse_long_arg(arg);
+        } else if (arg[0] == '-') {
+            parse_arg(arg);
+        }
     }
-    return false;
 }
 
-void print_size(uint64_t bytes) {
+void print_size(out_buffer *out, uint64_t bytes) {
     char size_header = '\0';
-    float size = 0;
+    uint64_t unit = 1;
     if (bytes >= GB(1)) {
         size_header = 'G';
-        size = (float)bytes / GB(1);
+        unit = GB(1);
     } else if (bytes >= MB(1)) {
         size_header = 'M';
-        size = (float)bytes / MB(1);
+        unit = MB(1);
     } else if (bytes >= KB(1)) {
         size_header = 'K';
-        size = (float)bytes / KB(1);
-    } else {
-        size = (float)bytes;
+        unit = KB(1);
     }
 
-    // TODO: cleanup
     if (size_header) {
-        if (size >= 100.0f) {
-            printf(" %d%c", (int)size, size_header);
-        } else if (size >= 10.0f) {
-            printf("  %d%c", (int)size, size_header);
+        uint64_t size = bytes / unit;
+        if (size >= 10) {
+            out_char(out, ' ');
+            out_uint(out, size, 3, ' ');
         } else {
-            printf(" %.1f%c", size, size_header);
-        } 
+            char digits[8];
+            int count = snprintf(digits, sizeof(digits), " %.1f", (float)bytes / unit);
+            out_write(out, digits, count);
+        }
+        out_char(out, size_header);
+    } else {
+        out_char(out, ' ');
+        out_uint(out, bytes, 4, ' ');
+    }
+}
+
+#define TIME_DAY_SLOTS 64
+#define TIME_SPAN_SLOTS 64
+// NOTE: offset changes are looked for a week apart, no zone keeps an offset for less than that
+#define TIME_PROBE_STEP (7 * 86400)
+// NOTE: how far a span is followed, zones without daylight saving would otherwise be probed forever
+#define TIME_PROBE_LIMIT (400 * 86400)
+// NOTE: files older than this, or from the future, show the year instead of the time of day
+#define TIME_SIX_MONTHS (31556952 / 2)
+
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// NOTE: seconds since 1970 from start up to end all have the same offset from UTC
+typedef struct {
+    int64_t start;
+    int64_t end;
+    int64_t offset;
+} time_span;
+
+// NOTE: the rendered date of one local calendar day, counted in days since 1970
+typedef struct {
+    int64_t day;
+    bool valid;
+    char date[7]; // "Mon dd "
+    char year[5]; // " yyyy"
+} time_day;
+
+// NOTE: per thread, long listings are rendered by several workers under -R
+typedef struct {
+    time_span spans[TIME_SPAN_SLOTS];
+    int span_count;
+    int last_span;
+    time_day days[TIME_DAY_SLOTS];
+    int64_t now;
+    int64_t stale; // the first second at which a time rendered since the refresh would print differently
+} time_cache;
+
+static XT_THREAD_LOCAL time_cache times;
+
+int64_t time_offset(int64_t when) {
+    xp_time local;
+    int64_t offset = 0;
+    // NOTE: out of range for the C library, taken as UTC
+    if (!xp_local_time(when, &local, &offset)) return 0;
+    return offset;
+}
+
+// NOTE: the furthest second from when in the direction of step that still has offset
+int64_t time_span_edge(int64_t when, int64_t offset, int64_t step) {
+    int64_t inside = when;
+    for (int64_t distance = step; distance <= TIME_PROBE_LIMIT && distance >= -TIME_PROBE_LIMIT; distance += step) {
+        int64_t outside = when + distance;
+        if (time_offset(outside) != offset) {
+            while (outside - inside > 1 || inside - outside > 1) {
+                int64_t middle = inside + (outside - inside) / 2;
+                if (time_offset(middle) == offset) inside = middle;
+                else outside = middle;
+            }
+            return inside;
+        }
+        inside = outside;
+    }
+    return inside;
+}
+
+// NOTE: localtime is only asked about spans not seen yet, and then just enough to find where they end
+int64_t time_local_offset(time_cache *cache, int64_t when) {
+    time_span *span = &cache->spans[cache->last_span];
+    if (cache->span_count && when >= span->start && when < span->end) {
+        return span->offset;
+    }
+    for (int i = 0; i < cache->span_count; i++) {
+        span = &cache->spans[i];
+        if (when >= span->start && when < span->end) {
+            cache->last_span = i;
+            return span->offset;
+        }
+    }
+
+    if (cache->span_count == TIME_SPAN_SLOTS) cache->span_count = 0;
+    cache->last_span = cache->span_count++;
+    span = &cache->spans[cache->last_span];
+    span->offset = time_offset(when);
+    span->start = time_span_edge(when, span->offset, -TIME_PROBE_STEP);
+    span->end = time_span_edge(when, span->offset, TIME_PROBE_STEP) + 1;
+    return span->offset;
+}
+
+// NOTE: proleptic Gregorian date of days since 1970, from Howard Hinnant's civil_from_days
+void time_civil(int64_t days, int *year, int *month, int *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t month_index = (5 * day_of_year + 2) / 153;
+    *day = (int)(day_of_year - (153 * month_index + 2) / 5 + 1);
+    *month = (int)(month_index < 10 ? month_index + 3 : month_index - 9);
+    *year = (int)(year_of_era + era * 400 + (*month <= 2));
+}
+
+void time_day_fill(time_day *entry, int64_t day) {
+    int year, month, month_day;
+    time_civil(day, &year, &month, &month_day);
+    entry->day = day;
+    entry->valid = true;
+    memcpy(entry->date, months[month - 1], 3);
+    entry->date[3] = ' ';
+    entry->date[4] = month_day < 10 ? ' ' : digit_pairs[2 * month_day];
+    entry->date[5] = digit_pairs[2 * month_day + 1];
+    entry->date[6] = ' ';
+    char text[16];
+    snprintf(text, sizeof(text), "%5d", year);
+    memcpy(entry->year, text, 5);
+}
+
+// NOTE: the six month cutoff is measured from the clock at the start of each listing, not from
+// the files. --watch and --daemon keep what they rendered, time_stale tells them when to redo it.
+void time_refresh() {
+    times.now = (int64_t)time(NULL);
+    times.stale = INT64_MAX;
+}
+
+int64_t time_stale() {
+    return times.stale;
+}
+
+// NOTE: "Mon dd HH:MM", or "Mon dd  yyyy" when the file is not recent
+void print_time(out_buffer *out, int64_t when) {
+    time_cache *cache = &times;
+    bool recent = when > cache->now - TIME_SIX_MONTHS && when <= cache->now;
+    // NOTE: a recent time turns old six months on, a future one turns recent when it arrives
+    int64_t stale = recent ? when + TIME_SIX_MONTHS : (when > cache->now ? when : INT64_MAX);
+    if (stale < cache->stale) cache->stale = stale;
+
+    int64_t local_seconds = when + time_local_offset(cache, when);
+    int64_t day = (local_seconds >= 0 ? local_seconds : local_seconds - 86399) / 86400;
+    time_day *entry = &cache->days[(uint64_t)day % TIME_DAY_SLOTS];
+    if (!entry->valid || entry->day != day) {
+        time_day_fill(entry, day);
+    }
+
+    out_reserve(out, 12);
+    char *text = out->data + out->count;
+    out->count += 12;
+    memcpy(text, entry->date, 7);
+    if (recent) {
+        int seconds = (int)(local_seconds - day * 86400);
+        memcpy(text + 7, digit_pairs + 2 * (seconds / 3600), 2);
+        text[9] = ':';
+        memcpy(text + 10, digit_pairs + 2 * (seconds / 60 % 60), 2);
     } else {
-        printf(" %*d", 4, (int)size);
+        memcpy(text + 7, entry->year, 5);
     }
 }
 
-void print_name(xp_file file) {
-    char *name = file.name;
-    bool spaces = has_spaces(file.name);
-    if (spaces) {
-        name = malloc(strlen(file.name) + 3);
-        name[0] = '\'';
-        strcpy(name + 1, file.name);
-        name[strlen(file.name) + 1] = '\'';
-        name[strlen(file.name) + 2] = 0;
+// NOTE: control characters become '?', everything else is written as it is
+void print_escaped(out_buffer *out, char *name, int length) {
+    const unsigned char *text = (const unsigned char *)name;
+    for (int i = 0; i < length;) {
+        uint32_t c = text[i];
+        int count = xp_utf8_decode(text + i, length - i, &c);
+        if (count == 0) count = 1;
+        if (xp_control(c)) out_char(out, '?');
+        else out_write(out, name + i, count);
+        i += count;
     }
+}
 
-    if (file.attributes & XP_DIRECTORY) 
-        cprint(0, 0x84, 0xD4, "%s", name);
-    else if (file.attributes & XP_EXECUTABLE)
-        cprint(0x56, 0xDB, 0x3A, "%s", name);
+// NOTE: as the width of the name was worked out, quoted when it has spaces
+void print_quoted(out_buffer *out, char *name, int length, uint8_t flags) {
+    bool quoted = flags & XP_NAME_QUOTED;
+    if (quoted) out_char(out, '\'');
+    if (flags & XP_NAME_ESCAPED) print_escaped(out, name, length);
+    else out_write(out, name, length);
+    if (quoted) out_char(out, '\'');
+}
+
+void print_name(out_buffer *out, const xp_directory *dir, uint32_t index) {
+    uint32_t attributes = dir->attributes[index];
+
+    if (color_output && (attributes & XP_DIRECTORY))
+        out_write(out, color_directory, sizeof(color_directory) - 1);
+    else if (color_output && (attributes & XP_EXECUTABLE))
+        out_write(out, color_executable, sizeof(color_executable) - 1);
     else
-        printf("%s", name);
-
-    if (spaces) free(name);
-}
-
-void print_wide_format(xp_directory dir) {
-    int max_name_length = 0;
-    for (int file_index = 0; file_index < dir.file_count; file_index++) {
-        char *name = dir.files[file_index].name;
-        int name_length = get_name_length(name);
-        if (name_length > max_name_length) max_name_length = name_length;
-    }
-    max_name_length += 2; // spaces
-    
-    int cols = line_length / max_name_length;// - ((line_length % max_name_length) != 0);
-    if (cols <= 0) cols = 1;
-    int rows = dir.file_count / cols;
-    if (rows <= 0) rows = 1;
-    cols = dir.file_count / rows;
-
-    int file_index = 0;
-    for (int row = 0; row < rows; row++) {
-        file_index = row;
-        for (int col = 0; col < cols; col++) {
-            if (file_index >= dir.file_count) break;
-            xp_file file = dir.files[file_index];
-
-            print_name(file);
-            if (col < cols - 1) {
-                int len = get_name_length(file.name);
-                int spaces = (rows == 1) ? 2 : max_name_length - len;
-                for (int i = 0; i < spaces; i++) {
-                    printf(" ");
-                }
+        attributes = 0;
+
+    print_quoted(out, xp_file_name(dir, index), dir->name_lengths[index], dir->name_flags[index]);
+
+    if (color_output && attributes) out_write(out, color_reset, sizeof(color_reset) - 1);
+}
+
+// NOTE: a one character name and the two spaces after it
+#define LAYOUT_MIN_COLUMN_WIDTH 3
+
+// NOTE: entries go down the columns in c columns of rows entries, each column as wide as its widest name
+typedef struct {
+    int rows;
+    int col;
+    int left; // entries still to come in col
+    int line_width;
+    int *widths;
+    uint64_t *starts; // what column_layout_add was given for the first entry of each column
+} layout_candidate;
+
+// NOTE: GNU ls style. Widths are fed in listing order once, and every candidate column count is
+// kept up to date as they come, so picking the densest layout that fits costs no second pass.
+typedef struct {
+    int max_cols; // candidates above this no longer fit
+    layout_candidate *candidates; // candidates[c - 1] has c columns
+    int *widths;
+    uint64_t *starts;
+} column_layout;
+
+void column_layout_init(column_layout *layout, int file_count, bool track_starts) {
+    int max_cols = (line_length + LAYOUT_MIN_COLUMN_WIDTH - 1) / LAYOUT_MIN_COLUMN_WIDTH;
+    max_cols = MAX(1, MIN(max_cols, file_count));
+    size_t slots = (size_t)max_cols * (max_cols + 1) / 2;
+    layout->max_cols = max_cols;
+    layout->candidates = calloc(max_cols, sizeof(layout_candidate));
+    layout->widths = calloc(slots, sizeof(int));
+    layout->starts = track_starts ? calloc(slots, sizeof(uint64_t)) : NULL;
+    size_t slot = 0;
+    for (int c = 1; c <= max_cols; c++) {
+        layout_candidate *candidate = &layout->candidates[c - 1];
+        candidate->rows = MAX(1, (file_count + c - 1) / c);
+        candidate->left = candidate->rows;
+        candidate->widths = layout->widths + slot;
+        candidate->starts = track_starts ? layout->starts + slot : NULL;
+        slot += c;
+    }
+}
+
+void column_layout_add(column_layout *layout, int width, uint64_t start) {
+    for (int c = 1; c <= layout->max_cols; c++) {
+        layout_candidate *candidate = &layout->candidates[c - 1];
+        if (candidate->left == 0) {
+            candidate->col++;
+            candidate->left = candidate->rows;
+        }
+        if (candidate->starts && candidate->left == candidate->rows) {
+            candidate->starts[candidate->col] = start;
+        }
+        candidate->left--;
+
+        // NOTE: two spaces after every column but the last
+        int column_width = width + (candidate->col == c - 1 ? 0 : 2);
+        int *widest = &candidate->widths[candidate->col];
+        if (column_width > *widest) {
+            candidate->line_width += column_width - *widest;
+            *widest = column_width;
+        }
+    }
+    // NOTE: lines only get longer, a candidate that is too wide stays that way
+    while (layout->max_cols > 1 && layout->candidates[layout->max_cols - 1].line_width >= line_length) {
+        layout->max_cols--;
+    }
+}
+
+// NOTE: the most columns that fit, one column when nothing does
+layout_candidate *column_layout_pick(column_layout *layout) {
+    for (int c = layout->max_cols; c > 1; c--) {
+        if (layout->candidates[c - 1].line_width < line_length) return &layout->candidates[c - 1];
+    }
+    return &layout->candidates[0];
+}
+
+void column_layout_free(column_layout *layout) {
+    free(layout->candidates);
+    free(layout->widths);
+    free(layout->starts);
+}
+
+// NOTE: the layout always covers every entry, only the first max_rows rows are printed
+void print_wide_rows(out_buffer *out, const xp_directory *dir, int max_rows) {
+    int file_count = dir->order_count;
+    column_layout layout;
+    column_layout_init(&layout, file_count, false);
+    for (int file_index = 0; file_index < file_count; file_index++) {
+        column_layout_add(&layout, dir->widths[dir->order[file_index]], 0);
+    }
+    layout_candidate *candidate = column_layout_pick(&layout);
+    int rows = candidate->rows;
+
+    for (int row = 0; row < MIN(rows, max_rows); row++) {
+        for (int file_index = row, col = 0; file_index < file_count; file_index += rows, col++) {
+            uint32_t index = dir->order[file_index];
+            print_name(out, dir, index);
+            if (file_index + rows < file_count) {
+                out_pad(out, candidate->widths[col] - dir->widths[index]);
             }
-            file_index += rows;
         }
-        putchar('\n');
+        out_char(out, '\n');
     }
+    column_layout_free(&layout);
+}
+
+void print_wide_format(out_buffer *out, const xp_directory *dir) {
+    print_wide_rows(out, dir, INT32_MAX);
 }
 
-void print_long_format(xp_directory dir) {
-    for (int file_index = 0; file_index < dir.file_count; file_index++) {
-        xp_file file = dir.files[file_index];
-        // size - month - day - time - name
-        // size := [0-9]* [KMGT]B
-        // day := [1-31]
-        // time [0-23] : [0-59]
+void print_long_entry(out_buffer *out, const xp_directory *dir, uint32_t index) {
+    // size - month - day - time - name
+    // size := [0-9]* [KMGT]B
+    // day := [1-31]
+    // time [0-23] : [0-59]
+
+    print_size(out, dir->sizes[index]);
+    out_char(out, ' ');
 
-        print_size(file.bytes);
-        putchar(' ');
+    print_time(out, xp_unix_time(dir->times[index]));
 
-        xp_time time = xp_utc_time(file.time);
-        printf("%s %*d %.2d:%.2d", months[time.month - 1], 2, time.day, time.hour, time.minute);
+    out_char(out, ' ');
+    print_name(out, dir, index);
+    out_char(out, '\n');
+}
 
-        putchar(' ');
-        print_name(file);
-        putchar('\n');
+void print_long_format(out_buffer *out, const xp_directory *dir) {
+    time_refresh();
+    for (int file_index = 0; file_index < dir->order_count; file_index++) {
+        print_long_entry(out, dir, dir->order[file_index]);
     }
 }
 
-void print_directory(xp_directory dir) {
+void print_directory_name(out_buffer *out, xp_path path) {
+    int length = (int)strlen((char *)path.data);
+    uint8_t flags = 0;
+    xp_name_width((char *)path.data, length, &flags);
+    print_quoted(out, (char *)path.data, length, flags);
+    out_write(out, ":\n", 2);
+}
+
+void print_directory(out_buffer *out, const xp_directory *dir) {
+    STATS_BEGIN(render);
     if (print_dir_name) {
-        if (has_spaces((char *)dir.path.data)) {
-            printf("'%s':\n", dir.path.data);
-        } else {
-            printf("%s:\n", dir.path.data);
-        }
+        print_directory_name(out, dir->path);
     }
 
     switch (print_format) {
     case FORMAT_WIDE:
-        print_wide_format(dir);
+        print_wide_format(out, dir);
         break;
     case FORMAT_LONG:
-        print_long_format(dir);
+        print_long_format(out, dir);
         break;
     }
+    STATS_ADD(entries_shown, dir->order_count);
+    STATS_END(render);
 }
 
-char *get_file_extension(char *file_name) {
-    char *extension = NULL;
-    for (int i = 0; file_name[i] != 0; i++) {
-        if (file_name[i] == '.') {
-            extension = file_name + i + 1;
-        }
+bool dot_directory(const xp_directory *dir, uint32_t index) {
+    char *name = xp_file_name(dir, index);
+    return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+// NOTE: comparators take the directory of each side, so entries of different directories can be ordered
+static inline int compare_file_name(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    int len1 = dir1->name_lengths[file1];
+    int len2 = dir2->name_lengths[file2];
+    int diff = memcmp(xp_file_name(dir1, file1), xp_file_name(dir2, file2), MIN(len1, len2));
+    if (diff) return diff;
+    return len1 - len2;
+}
+
+// NOTE: "." and ".." first, then files without an extension, ties broken by name
+static inline int compare_file_extension(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    bool dot1 = dot_directory(dir1, file1);
+    bool dot2 = dot_directory(dir2, file2);
+    if (dot1 != dot2) return dot1 ? -1 : 1;
+
+    int ext1 = dir1->ext_offsets[file1];
+    int ext2 = dir2->ext_offsets[file2];
+    if ((ext1 == 0) != (ext2 == 0)) return ext1 == 0 ? -1 : 1;
+    if (ext1 && ext2) {
+        int diff = strcmp(xp_file_name(dir1, file1) + ext1, xp_file_name(dir2, file2) + ext2);
+        if (diff) return diff;
     }
-    return extension;
+    return compare_file_name(dir1, file1, dir2, file2);
 }
 
-int compare_file_extension(xp_file file1, xp_file file2) {
-    if (strcmp(file1.name, ".") == 0) return -1;
-    if (strcmp(file1.name, "..") == 0) return -1;
+// NOTE: higher priority is later time, ties broken by name. Times before 1970 are negative.
+static inline int compare_file_time(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    int64_t time1 = (int64_t)dir1->times[file1];
+    int64_t time2 = (int64_t)dir2->times[file2];
+    if (time1 != time2) return time1 > time2 ? -1 : 1;
+    return compare_file_name(dir1, file1, dir2, file2);
+}
 
-    char *ext1 = get_file_extension(file1.name);
-    char *ext2 = get_file_extension(file2.name);
+// NOTE: largest first, ties broken by name
+static inline int compare_file_size(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    uint64_t size1 = dir1->sizes[file1];
+    uint64_t size2 = dir2->sizes[file2];
+    if (size1 != size2) return size1 > size2 ? -1 : 1;
+    return compare_file_name(dir1, file1, dir2, file2);
+}
 
-    if (ext1 == NULL && ext2 == NULL) return 0;
-    if (ext1 == NULL) return -1;
-    if (ext2 == NULL) return 1;
+static inline int compare_file_name_reverse(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    return compare_file_name(dir2, file2, dir1, file1);
+}
 
-   
-    int len1 = ext1 ? (int)strlen(ext1) : 0;
-    int len2 = ext2 ? (int)strlen(ext2) : 0;
-    int len = MIN(len1, len2);
-    for (int i = 0; i < len; i++) {
-        int diff = ext1[i] - ext2[i];
-        if (diff == 0) continue;
-        else return diff;
-    }
-    return 0;
+static inline int compare_file_extension_reverse(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    return compare_file_extension(dir2, file2, dir1, file1);
 }
 
-int compare_file_name(xp_file file1, xp_file file2) {
-    int len = (int)MIN(strlen(file1.name), strlen(file2.name));
-    for (int i = 0; i < len; i++) {
-        int diff = file1.name[i] - file2.name[i];
-        if (diff == 0) continue;
-        else return diff;
+int compare_files(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2, int sort_type) {
+    int result = 0;
+    switch (sort_type) {
+    case SORT_NAME: result = compare_file_name(dir1, file1, dir2, file2); break;
+    case SORT_EXTENSION: result = compare_file_extension(dir1, file1, dir2, file2); break;
+    case SORT_TIME: result = compare_file_time(dir1, file1, dir2, file2); break;
+    case SORT_SIZE: result = compare_file_size(dir1, file1, dir2, file2); break;
     }
-    return 0;
+    return reverse_order ? -result : result;
 }
 
-// NOTE: higher priority is later time
-int compare_file_time(xp_file file1, xp_file file2) {
-#ifdef _WIN32
-    FILETIME ft1 = {.dwLowDateTime = (uint32_t)file1.time, .dwHighDateTime = (uint32_t)(file1.time >> 32)};
-    FILETIME ft2 = {.dwLowDateTime = (uint32_t)file2.time, .dwHighDateTime = (uint32_t)(file2.time >> 32)};
-    // switched times (priority)
-    return CompareFileTime(&ft2, &ft1);
-#elif __linux__
-    return (int)difftime(file2.time, file1.time);
-#endif
+// NOTE: stable bottom-up merge sort, one copy per comparator so the compare call inlines
+#define SORT_RUN_LENGTH 16
+#define DEFINE_FILE_SORT(NAME, COMPARE) \
+void NAME(const xp_directory *dir, uint32_t *order, int count) { \
+    for (int start = 0; start < count; start += SORT_RUN_LENGTH) { \
+        int end = MIN(start + SORT_RUN_LENGTH, count); \
+        for (int i = start + 1; i < end; i++) { \
+            uint32_t key = order[i]; \
+            int j = i - 1; \
+            while (j >= start && COMPARE(dir, order[j], dir, key) > 0) { \
+                order[j + 1] = order[j]; \
+                j--; \
+            } \
+            order[j + 1] = key; \
+        } \
+    } \
+    if (count <= SORT_RUN_LENGTH) return; \
+    uint32_t *scratch = malloc(count * sizeof(uint32_t)); \
+    uint32_t *src = order; \
+    uint32_t *dst = scratch; \
+    for (int width = SORT_RUN_LENGTH; width < count; width *= 2) { \
+        for (int start = 0; start < count; start += 2 * width) { \
+            int mid = MIN(start + width, count); \
+            int end = MIN(start + 2 * width, count); \
+            int i = start, j = mid, k = start; \
+            while (i < mid && j < end) { \
+                if (COMPARE(dir, src[j], dir, src[i]) < 0) dst[k++] = src[j++]; \
+                else dst[k++] = src[i++]; \
+            } \
+            while (i < mid) dst[k++] = src[i++]; \
+            while (j < end) dst[k++] = src[j++]; \
+        } \
+        uint32_t *tmp = src; src = dst; dst = tmp; \
+    } \
+    if (src != order) memcpy(order, src, count * sizeof(uint32_t)); \
+    free(scratch); \
 }
 
-typedef int (*file_sort_t)(xp_file, xp_file);
+DEFINE_FILE_SORT(sort_files_by_name, compare_file_name)
+DEFINE_FILE_SORT(sort_files_by_name_reverse, compare_file_name_reverse)
+DEFINE_FILE_SORT(sort_files_by_extension, compare_file_extension)
+DEFINE_FILE_SORT(sort_files_by_extension_reverse, compare_file_extension_reverse)
 
-void sort_files(xp_directory *dir, file_sort_t sort_func) {
-    for (int i = 1; i < dir->file_count; i++) {
-        xp_file key = dir->files[i];
-        int j = i - 1;
-        while (j >= 0 && sort_func(dir->files[j], key) > 0) {
-            dir->files[j + 1] = dir->files[j];
-            j--;
+typedef struct {
+    uint64_t key;
+    uint32_t index;
+} sort_key;
+
+// NOTE: LSD radix sort, 8 bits per pass, passes where every key has the same byte are skipped
+void radix_sort_keys(sort_key *keys, int count) {
+    uint32_t counts[8][256] = {0};
+    for (int i = 0; i < count; i++) {
+        uint64_t key = keys[i].key;
+        for (int pass = 0; pass < 8; pass++) {
+            counts[pass][(key >> (pass * 8)) & 0xFF]++;
+        }
+    }
+
+    sort_key *scratch = malloc(count * sizeof(sort_key));
+    sort_key *src = keys;
+    sort_key *dst = scratch;
+    for (int pass = 0; pass < 8; pass++) {
+        int shift = pass * 8;
+        if (counts[pass][(keys[0].key >> shift) & 0xFF] == (uint32_t)count) continue;
+
+        uint32_t offsets[256];
+        uint32_t total = 0;
+        for (int i = 0; i < 256; i++) {
+            offsets[i] = total;
+            total += counts[pass][i];
+        }
+        for (int i = 0; i < count; i++) {
+            dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+        sort_key *tmp = src; src = dst; dst = tmp;
+    }
+    if (src != keys) memcpy(keys, src, count * sizeof(sort_key));
+    free(scratch);
+}
+
+// NOTE: numeric keys sort largest first unless reversed, flipping the key bits
+// does the reversal inside the radix passes. Equal keys fall back to name order.
+// NOTE: times before 1970 are negative, flipping the sign bit orders signed keys as unsigned ones
+void sort_files_by_key(xp_directory *dir, uint64_t *column, bool is_signed) {
+    int count = dir->order_count;
+    if (count <= 1) return;
+
+    bool ascending = reverse_order;
+    uint64_t sign = is_signed ? 1ull << 63 : 0;
+    sort_key *keys = malloc(count * sizeof(sort_key));
+    for (int i = 0; i < count; i++) {
+        uint32_t index = dir->order[i];
+        uint64_t key = column[index] ^ sign;
+        keys[i].key = ascending ? key : ~key;
+        keys[i].index = index;
+    }
+    radix_sort_keys(keys, count);
+
+    for (int i = 0; i < count; i++) {
+        dir->order[i] = keys[i].index;
+    }
+    for (int start = 0; start < count;) {
+        int end = start + 1;
+        while (end < count && keys[end].key == keys[start].key) end++;
+        if (end - start > 1) {
+            if (reverse_order) sort_files_by_name_reverse(dir, dir->order + start, end - start);
+            else sort_files_by_name(dir, dir->order + start, end - start);
         }
-        dir->files[j + 1] = key;
+        start = end;
     }
+    free(keys);
 }
 
 void sort_directory_files(xp_directory *dir, int sort_type) {
+    STATS_BEGIN(sort);
     switch (sort_type) {
     case SORT_NAME:
-        sort_files(dir, compare_file_name);
+        if (reverse_order) sort_files_by_name_reverse(dir, dir->order, dir->order_count);
+        else sort_files_by_name(dir, dir->order, dir->order_count);
         break;
     case SORT_EXTENSION:
-        sort_files(dir, compare_file_extension);
+        if (reverse_order) sort_files_by_extension_reverse(dir, dir->order, dir->order_count);
+        else sort_files_by_extension(dir, dir->order, dir->order_count);
         break;
     case SORT_TIME:
-        sort_files(dir, compare_file_time);
+        sort_files_by_key(dir, dir->times, true);
+        break;
+    case SORT_SIZE:
+        sort_files_by_key(dir, dir->sizes, false);
         break;
     }
+    STATS_END(sort);
 }
 
-bool abnormal_file(xp_file file) {
-    if (file.attributes & XP_HIDDEN) return true;
-    if (strncmp(file.name, ".", 1) == 0) return true;
-    if (strcmp(file.name, "..") == 0) return true;
+bool abnormal_file(const xp_directory *dir, uint32_t index) {
+    if (dir->attributes[index] & XP_HIDDEN) return true;
+    if (xp_file_name(dir, index)[0] == '.') return true;
     return false;
 }
 
-bool file_interesting(xp_file file) {
-    if (!all_files && abnormal_file(file)) return false;
-    return true;
+bool file_interesting(const xp_directory *dir, uint32_t index) {
+    if (!all_files && abnormal_file(dir, index)) return false;
+    return file_matches(dir, index);
 }
 
+// NOTE: only ask the scanner for the metadata the listing is going to look at
+uint32_t directory_scan_fields() {
+    uint32_t fields = 0;
+    if (color_output) fields |= XP_FIELD_ATTRIBUTES;
+    if (print_format == FORMAT_LONG) fields |= XP_FIELD_SIZE | XP_FIELD_TIME;
+    if (!unsorted && sort_file_type == SORT_TIME) fields |= XP_FIELD_TIME;
+    if (!unsorted && sort_file_type == SORT_SIZE) fields |= XP_FIELD_SIZE;
+    if (recursive) fields |= XP_FIELD_TYPE;
+    if (disk_usage) fields |= XP_FIELD_USAGE;
+    if (matcher.size_compare) fields |= XP_FIELD_SIZE;
+    if (matcher.mtime_compare) fields |= XP_FIELD_TIME;
+    if (matcher.type) fields |= XP_FIELD_TYPE;
+    if (!all_files) fields |= XP_SKIP_HIDDEN;
+    return fields;
+}
+
+// NOTE: name predicates are pushed down into the scanner so rejected entries are never stat'd
+xp_filter_proc scan_filter() {
+    return matcher_active ? matcher_filter : NULL;
+}
+
+// NOTE: the columns are left alone, dropping an entry is just taking it out of the order
 void filter_directory_files(xp_directory *dir) {
-    xp_file *files = malloc(dir->file_count * sizeof(xp_file));
-    int file_count = 0;
-    for (int i = 0; i < dir->file_count; i++) {
-        if (file_interesting(dir->files[i])) {
-            files[file_count] = dir->files[i];
-            file_count++;
-        } else {
-            free(dir->files[i].name);
+    STATS_BEGIN(filter);
+    int order_count = 0;
+    for (int i = 0; i < dir->order_count; i++) {
+        uint32_t index = dir->order[i];
+        if (file_interesting(dir, index)) {
+            dir->order[order_count++] = index;
         }
     }
-    free(dir->files);
-    files = realloc(files, file_count * sizeof(xp_file));
-    dir->files = files;
-    dir->file_count = file_count;
+    dir->order_count = order_count;
+    STATS_END(filter);
 }
 
-int main(int argc, char **argv) {
-    argc--; argv++;
-#ifdef _WIN32
-    CONSOLE_SCREEN_BUFFER_INFO screen_buffer_info;
-    HANDLE hc = GetStdHandle(STD_OUTPUT_HANDLE);
-    DWORD dw = 0;
+// NOTE: bounded heap of the entries that make the cut, the one listed last sits at the root
+typedef struct {
+    xp_directory dir;
+    uint32_t *heap;
+    int heap_count;
+    int limit;
+    size_t name_bytes;
+} top_files;
 
-    // NOTE: colored output on windows
-    GetConsoleMode(hc, &dw);
-    dw |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-    SetConsoleMode(hc, dw);
+static inline bool top_files_after(top_files *top, int i, int j) {
+    return compare_files(&top->dir, top->heap[i], &top->dir, top->heap[j], sort_file_type) > 0;
+}
 
-    GetConsoleScreenBufferInfo(hc, &screen_buffer_info);
+void top_files_sift_down(top_files *top, int i) {
+    for (;;) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < top->heap_count && top_files_after(top, left, largest)) largest = left;
+        if (right < top->heap_count && top_files_after(top, right, largest)) largest = right;
+        if (largest == i) break;
+        uint32_t tmp = top->heap[i]; top->heap[i] = top->heap[largest]; top->heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+bool top_files_visit(xp_directory *chunk, uint32_t index, void *user) {
+    top_files *top = (top_files *)user;
+    if (!file_interesting(chunk, index)) return true;
+
+    xp_file file = xp_directory_file(chunk, index);
+    if (top->heap_count < top->limit) {
+        int i = top->heap_count++;
+        top->heap[i] = xp_file_push(&top->dir, file.name, &file);
+        top->name_bytes += chunk->name_lengths[index] + 1;
+        while (i > 0 && top_files_after(top, i, (i - 1) / 2)) {
+            uint32_t tmp = top->heap[i]; top->heap[i] = top->heap[(i - 1) / 2]; top->heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (compare_files(chunk, index, &top->dir, top->heap[0], sort_file_type) < 0) {
+        uint32_t row = top->heap[0];
+        top->name_bytes -= top->dir.name_lengths[row];
+        top->name_bytes += chunk->name_lengths[index];
+        xp_file_replace(&top->dir, row, file.name, &file);
+        top_files_sift_down(top, 0);
+
+        // NOTE: replaced names that did not fit are garbage, keep the arena proportional to the limit
+        if (top->dir.names.used > 2 * top->name_bytes + XP_ARENA_BLOCK_SIZE) {
+            xp_directory_compact_names(&top->dir);
+        }
+    }
+    return true;
+}
+
+// NOTE: keeps only the first limit entries in listing order while scanning, nothing else is copied
+bool scan_directory_top(xp_path path, xp_directory *dir, int limit) {
+    top_files top = {0};
+    top.limit = limit;
+    top.heap = malloc(limit * sizeof(uint32_t));
+    bool result = xp_directory_visit(path, directory_scan_fields(), scan_filter(), NULL, top_files_visit, &top);
+    free(top.heap);
+
+    xp_path full_path = xp_path_copy(path);
+    xp_normalize(&full_path);
+    top.dir.path = full_path;
+    xp_directory_reset_order(&top.dir);
+    *dir = top.dir;
+    if (!result) return false;
+
+    sort_directory_files(dir, sort_file_type);
+    return true;
+}
+
+typedef struct {
+    out_buffer *out;
+    int column;
+    int printed;
+    bool flushed;
+} file_stream;
+
+// NOTE: prints entries in directory order as the scanner hands them out, wide output just wraps at the line length
+bool stream_visit(xp_directory *chunk, uint32_t index, void *user) {
+    file_stream *stream = (file_stream *)user;
+    if (!file_interesting(chunk, index)) return true;
+
+    if (print_format == FORMAT_LONG) {
+        print_long_entry(stream->out, chunk, index);
+    } else {
+        int width = chunk->widths[index];
+        if (stream->column > 0 && stream->column + 2 + width > line_length) {
+            out_char(stream->out, '\n');
+            stream->column = 0;
+        } else if (stream->column > 0) {
+            out_pad(stream->out, 2);
+            stream->column += 2;
+        }
+        print_name(stream->out, chunk, index);
+        stream->column += width;
+    }
+
+    // NOTE: get the first line out right away, everything after that is batched
+    if (!stream->flushed) {
+        out_flush(stream->out);
+        stream->flushed = true;
+    }
+    stream->printed++;
+    STATS_ADD(entries_shown, 1);
+    return limit_count == 0 || stream->printed < limit_count;
+}
+
+bool stream_directory(out_buffer *out, xp_path path) {
+    out_flush(out);
+    if (print_dir_name) {
+        print_directory_name(out, path);
+    }
+
+    file_stream stream = {0};
+    stream.out = out;
+    time_refresh();
+    if (!xp_directory_visit(path, directory_scan_fields(), scan_filter(), NULL, stream_visit, &stream)) {
+        out->count = 0;
+        return false;
+    }
+    if (stream.column > 0) {
+        out_char(out, '\n');
+    }
+    return true;
+}
+
+// NOTE: --memory bounds a sorted listing. Entries past the budget are sorted into runs spilled to
+// temporary files, and the runs are merged back in listing order. Runs are written as one record per entry.
+typedef struct {
+    uint64_t size;
+    uint64_t time;
+    uint32_t attributes;
+    uint16_t name_length;
+    uint16_t ext_offset;
+    uint16_t width;
+    uint8_t name_flags;
+    uint8_t reserved;
+} spill_record;
+
+// NOTE: rough bytes per entry of an xp_directory, its columns plus what sorting takes on top
+#define SPILL_ENTRY_BYTES 64
+// NOTE: runs merged at once, more than this go through intermediate merges first
+#define SPILL_FAN_IN 64
+
+#ifdef _WIN32
+#define spill_seek _fseeki64
+#define spill_tell _ftelli64
+#elif defined(__linux__)
+#define spill_seek fseeko
+#define spill_tell ftello
+#endif
+
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} spill_run;
+
+typedef struct {
+    xp_directory run;
+    FILE *file;
+    spill_run *runs;
+    int run_count;
+    uint64_t file_count;
+    bool failed;
+} spill_state;
+
+// NOTE: a run being read back, a window of its entries at a time. Readers of one file share it
+// and seek to their own offset before every refill.
+typedef struct {
+    FILE *file;
+    uint64_t offset;
+    uint64_t remaining;
+    xp_directory window;
+    int next;
+    size_t window_bytes;
+} spill_reader;
+
+typedef void (*spill_sink)(const xp_directory *dir, uint32_t index, void *user);
+
+size_t spill_directory_bytes(const xp_directory *dir) {
+    return (size_t)dir->file_count * SPILL_ENTRY_BYTES + dir->names.used;
+}
+
+bool spill_write_entry(FILE *file, const xp_directory *dir, uint32_t index) {
+    spill_record record = {0};
+    record.size = dir->sizes[index];
+    record.time = dir->times[index];
+    record.attributes = dir->attributes[index];
+    record.name_length = dir->name_lengths[index];
+    record.ext_offset = dir->ext_offsets[index];
+    record.width = dir->widths[index];
+    record.name_flags = dir->name_flags[index];
+    return fwrite(&record, sizeof(record), 1, file) == 1 &&
+        fwrite(xp_file_name(dir, index), record.name_length, 1, file) == 1;
+}
+
+FILE *spill_file_new() {
+    FILE *file = tmpfile();
+    if (file) setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    return file;
+}
+
+// NOTE: sorts what has been scanned so far and appends it to the spill file as one run
+void spill_run_out(spill_state *spill) {
+    xp_directory *run = &spill->run;
+    if (run->file_count == 0 || spill->failed) return;
+    if (!spill->file) spill->file = spill_file_new();
+    if (!spill->file) {
+        spill->failed = true;
+        return;
+    }
+
+    xp_directory_reset_order(run);
+    sort_directory_files(run, sort_file_type);
+    spill->runs = realloc(spill->runs, (spill->run_count + 1) * sizeof(spill_run));
+    spill_run *current = &spill->runs[spill->run_count++];
+    current->offset = (uint64_t)spill_tell(spill->file);
+    current->count = run->order_count;
+    for (int i = 0; i < run->order_count && !spill->failed; i++) {
+        spill->failed = !spill_write_entry(spill->file, run, run->order[i]);
+    }
+    xp_directory_clear(run);
+}
+
+bool spill_visit(xp_directory *chunk, uint32_t index, void *user) {
+    spill_state *spill = (spill_state *)user;
+    if (!file_interesting(chunk, index)) return true;
+
+    xp_file_copy(&spill->run, chunk, index);
+    spill->file_count++;
+    // NOTE: half the budget, the columns and the name arena grow by doubling
+    if (spill_directory_bytes(&spill->run) >= memory_budget / 2) {
+        spill_run_out(spill);
+    }
+    return !spill->failed;
+}
+
+void spill_reader_open(spill_reader *reader, FILE *file, uint64_t offset, uint64_t count, size_t window_bytes) {
+    memset(reader, 0, sizeof(spill_reader));
+    reader->file = file;
+    reader->offset = offset;
+    reader->remaining = count;
+    reader->window_bytes = window_bytes;
+}
+
+bool spill_reader_fill(spill_reader *reader) {
+    xp_directory *window = &reader->window;
+    xp_directory_clear(window);
+    reader->next = 0;
+    if (reader->remaining == 0 || spill_seek(reader->file, (int64_t)reader->offset, SEEK_SET) != 0) {
+        return false;
+    }
+    while (reader->remaining > 0 && (window->file_count == 0 || spill_directory_bytes(window) < reader->window_bytes)) {
+        spill_record record;
+        if (fread(&record, sizeof(record), 1, reader->file) != 1) break;
+        uint32_t index = xp_file_reserve(window);
+        uint32_t offset = xp_arena_push(&window->names, record.name_length + 1);
+        char *name = window->names.data + offset;
+        if (record.name_length && fread(name, record.name_length, 1, reader->file) != 1) {
+            window->file_count--;
+            break;
+        }
+        name[record.name_length] = '\0';
+        window->name_offsets[index] = offset;
+        window->name_lengths[index] = record.name_length;
+        window->ext_offsets[index] = record.ext_offset;
+        window->widths[index] = record.width;
+        window->name_flags[index] = record.name_flags;
+        window->sizes[index] = record.size;
+        window->times[index] = record.time;
+        window->attributes[index] = record.attributes;
+        reader->remaining--;
+    }
+    // NOTE: a short read leaves the run cut off instead of looping on it
+    if (window->file_count == 0) reader->remaining = 0;
+    reader->offset = (uint64_t)spill_tell(reader->file);
+    return window->file_count > 0;
+}
+
+bool spill_reader_next(spill_reader *reader) {
+    reader->next++;
+    return reader->next < reader->window.file_count || spill_reader_fill(reader);
+}
+
+static inline bool spill_before(spill_reader *a, spill_reader *b) {
+    return compare_files(&a->window, a->next, &b->window, b->next, sort_file_type) < 0;
+}
+
+// NOTE: k-way merge on a heap of readers keyed by their current entry
+void spill_merge(spill_reader *readers, int count, spill_sink sink, void *user) {
+    spill_reader **heap = malloc(MAX(1, count) * sizeof(spill_reader *));
+    int heap_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (spill_reader_fill(&readers[i])) heap[heap_count++] = &readers[i];
+    }
+    for (int start = heap_count / 2 - 1; start >= 0; start--) {
+        for (int i = start;;) {
+            int least = i;
+            int left = 2 * i + 1;
+            if (left < heap_count && spill_before(heap[left], heap[least])) least = left;
+            if (left + 1 < heap_count && spill_before(heap[left + 1], heap[least])) least = left + 1;
+            if (least == i) break;
+            spill_reader *tmp = heap[i]; heap[i] = heap[least]; heap[least] = tmp;
+            i = least;
+        }
+    }
+
+    while (heap_count > 0) {
+        spill_reader *reader = heap[0];
+        sink(&reader->window, reader->next, user);
+        if (!spill_reader_next(reader)) {
+            heap[0] = heap[--heap_count];
+        }
+        for (int i = 0;;) {
+            int least = i;
+            int left = 2 * i + 1;
+            if (left < heap_count && spill_before(heap[left], heap[least])) least = left;
+            if (left + 1 < heap_count && spill_before(heap[left + 1], heap[least])) least = left + 1;
+            if (least == i) break;
+            spill_reader *tmp = heap[i]; heap[i] = heap[least]; heap[least] = tmp;
+            i = least;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        xp_directory_free(&readers[i].window);
+    }
+    free(heap);
+}
+
+typedef struct {
+    FILE *file;
+    uint64_t written;
+    uint64_t offset; // of the next entry in file
+    column_layout *layout; // given the width and offset of every entry, NULL for none
+    bool failed;
+} spill_writer;
+
+void spill_write_sink(const xp_directory *dir, uint32_t index, void *user) {
+    spill_writer *writer = (spill_writer *)user;
+    if (writer->layout) {
+        column_layout_add(writer->layout, dir->widths[index], writer->offset);
+    }
+    writer->failed = writer->failed || !spill_write_entry(writer->file, dir, index);
+    writer->written++;
+    writer->offset += sizeof(spill_record) + dir->name_lengths[index];
+}
+
+void spill_long_sink(const xp_directory *dir, uint32_t index, void *user) {
+    print_long_entry((out_buffer *)user, dir, index);
+    STATS_ADD(entries_shown, 1);
+}
+
+// NOTE: merges runs first to first + count of the spill file into a single run of file
+bool spill_merge_runs(spill_state *spill, int first, int count, spill_writer *writer) {
+    size_t window_bytes = MAX(memory_budget / 2 / count, 4096);
+    spill_reader *readers = malloc(count * sizeof(spill_reader));
+    for (int i = 0; i < count; i++) {
+        spill_run *run = &spill->runs[first + i];
+        spill_reader_open(&readers[i], spill->file, run->offset, run->count, window_bytes);
+    }
+    spill_merge(readers, count, spill_write_sink, writer);
+    free(readers);
+    return !writer->failed && !ferror(spill->file);
+}
+
+// NOTE: one pass turns every SPILL_FAN_IN runs into one, until a single merge can take them all
+bool spill_reduce_runs(spill_state *spill) {
+    while (spill->run_count > SPILL_FAN_IN) {
+        FILE *file = spill_file_new();
+        if (!file) return false;
+        int run_count = 0;
+        spill_run *runs = malloc(((spill->run_count + SPILL_FAN_IN - 1) / SPILL_FAN_IN) * sizeof(spill_run));
+        for (int first = 0; first < spill->run_count; first += SPILL_FAN_IN) {
+            int count = MIN(SPILL_FAN_IN, spill->run_count - first);
+            spill_writer writer = {.file = file};
+            runs[run_count].offset = (uint64_t)spill_tell(file);
+            if (!spill_merge_runs(spill, first, count, &writer)) {
+                fclose(file);
+                free(runs);
+                return false;
+            }
+            runs[run_count++].count = writer.written;
+        }
+        fclose(spill->file);
+        free(spill->runs);
+        spill->file = file;
+        spill->runs = runs;
+        spill->run_count = run_count;
+    }
+    return true;
+}
+
+// NOTE: the same layout as print_wide_format. The runs are merged into one more file first, laying
+// it out on the way and noting where every candidate's columns start, then a reader per column
+// walks down its part of it while the rows are printed.
+bool spill_print_wide(out_buffer *out, spill_state *spill) {
+    FILE *file = spill_file_new();
+    if (!file) return false;
+    column_layout layout;
+    column_layout_init(&layout, (int)spill->file_count, true);
+    spill_writer writer = {.file = file};
+    writer.layout = &layout;
+    bool merged = spill_merge_runs(spill, 0, spill->run_count, &writer);
+    merged = merged && fflush(file) == 0;
+
+    layout_candidate *candidate = column_layout_pick(&layout);
+    int rows = candidate->rows;
+    int columns = (int)((spill->file_count + rows - 1) / rows);
+    spill_reader *readers = malloc(MAX(1, columns) * sizeof(spill_reader));
+    size_t window_bytes = MAX(memory_budget / 2 / MAX(1, columns), 4096);
+    for (int col = 0; col < columns; col++) {
+        uint64_t count = MIN((uint64_t)rows, spill->file_count - (uint64_t)col * rows);
+        spill_reader_open(&readers[col], file, candidate->starts[col], count, window_bytes);
+        if (merged) spill_reader_fill(&readers[col]);
+    }
+
+    for (int row = 0; merged && row < rows; row++) {
+        for (int col = 0; col < columns; col++) {
+            spill_reader *reader = &readers[col];
+            if (reader->next >= reader->window.file_count) break;
+
+            print_name(out, &reader->window, reader->next);
+            STATS_ADD(entries_shown, 1);
+            if ((uint64_t)(col + 1) * rows + row < spill->file_count) {
+                out_pad(out, candidate->widths[col] - reader->window.widths[reader->next]);
+            }
+            spill_reader_next(reader);
+        }
+        out_char(out, '\n');
+    }
+
+    for (int col = 0; col < columns; col++) {
+        xp_directory_free(&readers[col].window);
+    }
+    free(readers);
+    column_layout_free(&layout);
+    fclose(file);
+    return merged;
+}
+
+// NOTE: a sorted listing that keeps under memory_budget. When everything fits, nothing is spilled
+// and it is printed like any other directory. False only when the directory could not be read.
+bool spill_directory(out_buffer *out, xp_path path) {
+    spill_state spill = {0};
+    spill.run.fields = directory_scan_fields();
+    bool scanned = xp_directory_visit(path, directory_scan_fields(), scan_filter(), NULL, spill_visit, &spill);
+    xp_path full_path = xp_path_copy(path);
+    xp_normalize(&full_path);
+    spill.run.path = full_path;
+    if (!scanned) {
+        xp_directory_free(&spill.run);
+        free(spill.runs);
+        if (spill.file) fclose(spill.file);
+        return false;
+    }
+
+    bool listed = true;
+    if (spill.run_count == 0) {
+        xp_directory_reset_order(&spill.run);
+        sort_directory_files(&spill.run, sort_file_type);
+        print_directory(out, &spill.run);
+    } else {
+        spill_run_out(&spill);
+        if (print_dir_name) {
+            print_directory_name(out, spill.run.path);
+        }
+        listed = !spill.failed && spill_reduce_runs(&spill);
+        if (listed && print_format == FORMAT_LONG) {
+            size_t window_bytes = MAX(memory_budget / 2 / spill.run_count, 4096);
+            spill_reader *readers = malloc(spill.run_count * sizeof(spill_reader));
+            for (int i = 0; i < spill.run_count; i++) {
+                spill_reader_open(&readers[i], spill.file, spill.runs[i].offset, spill.runs[i].count, window_bytes);
+            }
+            time_refresh();
+            spill_merge(readers, spill.run_count, spill_long_sink, out);
+            free(readers);
+        } else if (listed) {
+            listed = spill_print_wide(out, &spill);
+        }
+        if (!listed) {
+            out_flush(out);
+            fprintf(stderr, "Lister: failed to spill '%s' to a temporary file\n", spill.run.path.data);
+        }
+    }
+    xp_directory_free(&spill.run);
+    free(spill.runs);
+    if (spill.file) fclose(spill.file);
+    return true;
+}
+
+uint64_t fnv_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#ifdef __linux__
+
+// NOTE: everything that changes which entries are kept and in what order
+uint64_t cache_key() {
+    uint32_t options[] = {directory_scan_fields(), sort_file_type, reverse_order, all_files, unsorted, limit_count};
+    uint64_t hash = fnv_hash(0xcbf29ce484222325ull, options, sizeof(options));
+    if (!matcher_active) return hash;
+
+    for (int i = 0; i < matcher.include_count; i++) {
+        hash = fnv_hash(hash, "+", 1);
+        hash = fnv_hash(hash, &matcher.include[i].kind, sizeof(int));
+        hash = fnv_hash(hash, matcher.include[i].text, matcher.include[i].length);
+    }
+    for (int i = 0; i < matcher.ignore_count; i++) {
+        hash = fnv_hash(hash, "-", 1);
+        hash = fnv_hash(hash, &matcher.ignore[i].kind, sizeof(int));
+        hash = fnv_hash(hash, matcher.ignore[i].text, matcher.ignore[i].length);
+    }
+    // NOTE: --mtime depends on the day the listing was made
+    int64_t predicates[] = {matcher.size_compare, (int64_t)matcher.size, matcher.mtime_compare, matcher.mtime_days,
+                            matcher.type, matcher.mtime_compare ? matcher.now / 86400 : 0};
+    return fnv_hash(hash, predicates, sizeof(predicates));
+}
+
+// NOTE: $XDG_CACHE_HOME/lister, or ~/.cache/lister
+bool cache_init() {
+    char *base = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    size_t size = 0;
+    if (base && base[0] == '/') {
+        size = strlen(base) + sizeof("/lister");
+        cache_dir = malloc(size);
+        snprintf(cache_dir, size, "%s/lister", base);
+        mkdir(base, 0700);
+    } else if (home) {
+        size = strlen(home) + sizeof("/.cache/lister");
+        cache_dir = malloc(size);
+        snprintf(cache_dir, size, "%s/.cache", home);
+        mkdir(cache_dir, 0700);
+        strcat(cache_dir, "/lister");
+    } else {
+        return false;
+    }
+    mkdir(cache_dir, 0700);
+    return true;
+}
+
+char *cache_file_name(xp_path path, uint64_t key) {
+    uint64_t hash = fnv_hash(key, path.data, path.count);
+    size_t size = strlen(cache_dir) + 18;
+    char *file_name = malloc(size);
+    snprintf(file_name, size, "%s/%016llx", cache_dir, (unsigned long long)hash);
+    return file_name;
+}
+
+// NOTE: a directory changed within the last couple of seconds could change again without moving
+// its timestamps on filesystems with coarse times, so it is not worth trusting yet
+bool cache_stamp_settled(xp_dir_stamp *stamp) {
+    int64_t now = (int64_t)time(NULL);
+    return stamp->mtime_sec < now - 1 && stamp->ctime_sec < now - 1;
+}
+#endif
+
+// NOTE: scan, filter and sort one directory the way the flags ask for
+bool list_directory_scan(xp_path path, xp_directory *dir) {
+    if (limit_count > 0) {
+        return scan_directory_top(path, dir, limit_count);
+    }
+    if (!xp_directory_scan_filtered(path, dir, directory_scan_fields(), scan_filter(), NULL)) {
+        return false;
+    }
+    filter_directory_files(dir);
+    if (!unsorted) {
+        sort_directory_files(dir, sort_file_type);
+    }
+    return true;
+}
+
+// NOTE: with --cache, a directory whose stamp has not moved is mapped back already filtered and sorted.
+// The stamp is taken before scanning so a change during the scan is never saved as current.
+// Only the directory itself is checked, a file changing size or time in place goes unnoticed.
+bool list_directory(xp_path path, xp_directory *dir) {
+#ifdef __linux__
+    if (use_cache && cache_dir) {
+        xp_dir_stamp stamp;
+        if (!xp_directory_stamp(path, &stamp)) {
+            return list_directory_scan(path, dir);
+        }
+        // NOTE: keyed by the resolved path the scan stores, so links and trailing slashes hit the same file
+        xp_path full_path = xp_fullpath(path);
+        uint64_t key = cache_key();
+        char *file_name = cache_file_name(full_path, key);
+        bool listed = xp_directory_map(dir, file_name, full_path, &stamp, key);
+        if (!listed && (listed = list_directory_scan(path, dir)) && cache_stamp_settled(&stamp)) {
+            xp_directory_save(dir, file_name, &stamp, key);
+        }
+        free(file_name);
+        if (full_path.data != path.data) xp_path_free(&full_path);
+        return listed;
+    }
+#endif
+    return list_directory_scan(path, dir);
+}
+
+// NOTE: one directory of a recursive listing, rendered by whichever worker picks it up
+typedef struct dir_node {
+    xp_path path;
+    out_buffer out;
+    struct dir_node **children;
+    int child_count;
+    bool done;
+    bool failed;
+
+    // NOTE: -D subtree tasks add their usage into total and are never printed,
+    // the listing they belong to waits until its pending count drops to zero
+    struct dir_node *owner;
+    uint64_t *total;
+    uint64_t device;
+    uint32_t rank; // position in the owner's listing of the entry the task counts towards
+    int pending;
+    struct inode_set *inodes;
+
+    // NOTE: --snapshot hands the scanned directory to the main thread,
+    // --diff compares it with directory old of the snapshot
+    xp_directory *listing;
+    uint32_t old;
+} dir_node;
+
+// NOTE: the owner pushes and pops at the tail, idle workers steal from the head
+typedef struct {
+    xt_mutex mutex;
+    dir_node **items;
+    int head;
+    int tail;
+    int cap;
+} work_deque;
+
+typedef struct {
+    xt_mutex mutex;
+    xt_cond work_cond;
+    xt_cond done_cond;
+    int queued;
+    int active;
+    work_deque *deques;
+    int worker_count;
+    xt_thread *threads;
+    int thread_count;
+} walk_scheduler;
+
+static walk_scheduler scheduler;
+
+dir_node *dir_node_new(xp_path path) {
+    dir_node *node = calloc(1, sizeof(dir_node));
+    node->path = path;
+    node->out.fd = -1;
+    return node;
+}
+
+void dir_node_free(dir_node *node) {
+    if (node->listing) {
+        xp_directory_free(node->listing);
+        free(node->listing);
+    }
+    xp_path_free(&node->path);
+    free(node->out.data);
+    free(node->children);
+    free(node);
+}
+
+void work_deque_push(work_deque *deque, dir_node *node) {
+    xt_mutex_lock(&deque->mutex);
+    if (deque->tail == deque->cap) {
+        int count = deque->tail - deque->head;
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, count * sizeof(dir_node *));
+        }
+        if (count == deque->cap) {
+            deque->cap = deque->cap ? deque->cap * 2 : 64;
+            deque->items = realloc(deque->items, deque->cap * sizeof(dir_node *));
+        }
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->items[deque->tail++] = node;
+    xt_mutex_unlock(&deque->mutex);
+}
+
+dir_node *work_deque_take(work_deque *deque, bool steal) {
+    dir_node *node = NULL;
+    xt_mutex_lock(&deque->mutex);
+    if (deque->head < deque->tail) {
+        node = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    }
+    xt_mutex_unlock(&deque->mutex);
+    return node;
+}
+
+// NOTE: counters go up before the node is visible, so active never drops to zero while work is left
+void scheduler_push(int worker, dir_node *node) {
+    xt_mutex_lock(&scheduler.mutex);
+    scheduler.active++;
+    scheduler.queued++;
+    if (node->owner) node->owner->pending++;
+    xt_cond_signal(&scheduler.work_cond);
+    xt_mutex_unlock(&scheduler.mutex);
+    work_deque_push(&scheduler.deques[worker], node);
+}
+
+dir_node *scheduler_try_take(int worker) {
+    dir_node *node = work_deque_take(&scheduler.deques[worker], false);
+    for (int i = 1; !node && i < scheduler.worker_count; i++) {
+        node = work_deque_take(&scheduler.deques[(worker + i) % scheduler.worker_count], true);
+    }
+    if (node) {
+        xt_mutex_lock(&scheduler.mutex);
+        scheduler.queued--;
+        xt_mutex_unlock(&scheduler.mutex);
+    }
+    return node;
+}
+
+dir_node *scheduler_take(int worker) {
+    for (;;) {
+        dir_node *node = scheduler_try_take(worker);
+        if (node) {
+            return node;
+        }
+
+        xt_mutex_lock(&scheduler.mutex);
+        if (scheduler.active == 0) {
+            xt_mutex_unlock(&scheduler.mutex);
+            return NULL;
+        }
+        if (scheduler.queued <= 0) {
+            xt_cond_wait(&scheduler.work_cond, &scheduler.mutex);
+        }
+        xt_mutex_unlock(&scheduler.mutex);
+    }
+}
+
+void scheduler_finish(dir_node *node) {
+    xt_mutex_lock(&scheduler.mutex);
+    node->done = true;
+    scheduler.active--;
+    xt_cond_broadcast(&scheduler.done_cond);
+    bool joined = node->owner && --node->owner->pending == 0;
+    if (scheduler.active == 0 || joined) {
+        xt_cond_broadcast(&scheduler.work_cond);
+    }
+    xt_mutex_unlock(&scheduler.mutex);
+}
+
+bool subdirectory(const xp_directory *dir, uint32_t index) {
+    uint32_t attributes = dir->attributes[index];
+    return (attributes & XP_DIRECTORY) && !(attributes & XP_LINK) && !dot_directory(dir, index);
+}
+
+void run_task(int worker, dir_node *node);
+bool snapshot_list(xp_path path, xp_directory *dir);
+uint32_t *diff_directory(dir_node *node, xp_directory *dir);
+
+// NOTE: (device, inode) of every hard linked file under one -D listing, with the first entry in
+// listing order that reaches it and its size, so each one is counted once and always towards the
+// same entry, whichever worker gets there first. Sharded so workers rarely wait on each other.
+#define INODE_SET_SHARDS 64
+
+typedef struct {
+    xt_mutex mutex;
+    uint64_t *keys; // device, inode, rank, bytes, inode 0 marks an empty slot
+    int count;
+    int cap;
+} inode_shard;
+
+typedef struct inode_set {
+    inode_shard shards[INODE_SET_SHARDS];
+} inode_set;
+
+uint64_t inode_hash(uint64_t device, uint64_t inode) {
+    uint64_t hash = (inode ^ (device * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 29);
+}
+
+// NOTE: the pair keeps the lowest rank it is claimed with
+void inode_set_claim(inode_set *set, uint64_t device, uint64_t inode, uint32_t rank, uint64_t bytes) {
+    uint64_t hash = inode_hash(device, inode);
+    inode_shard *shard = &set->shards[hash % INODE_SET_SHARDS];
+    hash /= INODE_SET_SHARDS;
+
+    xt_mutex_lock(&shard->mutex);
+    if (2 * (shard->count + 1) > shard->cap) {
+        int cap = shard->cap ? shard->cap * 2 : 256;
+        uint64_t *keys = calloc(4 * cap, sizeof(uint64_t));
+        for (int i = 0; i < shard->cap; i++) {
+            if (!shard->keys[4 * i + 1]) continue;
+            uint64_t slot = inode_hash(shard->keys[4 * i], shard->keys[4 * i + 1]) / INODE_SET_SHARDS;
+            while (keys[4 * (slot & (cap - 1)) + 1]) slot++;
+            memcpy(&keys[4 * (slot & (cap - 1))], &shard->keys[4 * i], 4 * sizeof(uint64_t));
+        }
+        free(shard->keys);
+        shard->keys = keys;
+        shard->cap = cap;
+    }
+    for (uint64_t slot = hash;; slot++) {
+        uint64_t *key = &shard->keys[4 * (slot & (shard->cap - 1))];
+        if (!key[1]) {
+            key[0] = device;
+            key[1] = inode;
+            key[2] = rank;
+            key[3] = bytes;
+            shard->count++;
+            break;
+        }
+        if (key[0] == device && key[1] == inode) {
+            if (rank < key[2]) key[2] = rank;
+            break;
+        }
+    }
+    xt_mutex_unlock(&shard->mutex);
+}
+
+// NOTE: adds every file to the entry that claimed it first, once all tasks are done
+void inode_set_charge(inode_set *set, xp_directory *dir) {
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        inode_shard *shard = &set->shards[i];
+        for (int slot = 0; slot < shard->cap; slot++) {
+            uint64_t *key = &shard->keys[4 * slot];
+            if (key[1]) dir->sizes[dir->order[key[2]]] += key[3];
+        }
+    }
+}
+
+inode_set *inode_set_new() {
+    inode_set *set = calloc(1, sizeof(inode_set));
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        xt_mutex_init(&set->shards[i].mutex);
+    }
+    return set;
+}
+
+void inode_set_free(inode_set *set) {
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        xt_mutex_destroy(&set->shards[i].mutex);
+        free(set->shards[i].keys);
+    }
+    free(set);
+}
+
+bool usage_subdirectory(const xp_directory *dir, uint32_t index, uint64_t device) {
+    uint32_t attributes = dir->attributes[index];
+    return (attributes & XP_DIRECTORY) && !(attributes & XP_LINK) && dir->devices[index] == device;
+}
+
+void push_usage_task(int worker, dir_node *owner, xp_path parent, char *name, uint64_t *total, uint64_t device,
+                     uint32_t rank) {
+    xp_path path = xp_path_copy(parent);
+    xp_append(&path, name);
+    dir_node *task = dir_node_new(path);
+    task->owner = owner;
+    task->total = total;
+    task->device = device;
+    task->rank = rank;
+    scheduler_push(worker, task);
+}
+
+// NOTE: a -D subtree task, hidden entries count too and nothing leaves the starting filesystem
+void usage_directory(int worker, dir_node *node) {
+    xp_iter iter;
+    uint64_t total = 0;
+    if (xp_iter_open(&iter, node->path, XP_FIELD_USAGE, NULL, NULL)) {
+        xp_file file;
+        while (xp_iter_next(&iter, &file)) {
+            char *name = file.name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (file.attributes & XP_HARDLINKED) {
+                inode_set_claim(node->owner->inodes, file.device, file.inode, node->rank, file.bytes);
+                continue;
+            }
+            total += file.bytes;
+            if (usage_subdirectory(&iter.chunk, iter.index, node->device)) {
+                push_usage_task(worker, node->owner, node->path, name, node->total, node->device, node->rank);
+            }
+        }
+    }
+    xp_iter_close(&iter);
+    __atomic_fetch_add(node->total, total, __ATOMIC_RELAXED);
+}
+
+// NOTE: replaces the size of every subdirectory in the listing by the size of its whole tree.
+// The listing's worker keeps running tasks until its own subtrees are done. A hard linked file
+// counts once, towards the first entry in listing order that reaches it, as du does with its
+// arguments. Hard linked files in the listing itself take part too.
+void usage_totals(int worker, dir_node *node, xp_directory *dir) {
+    xp_file root;
+    if (!xp_path_stat(dir->path, XP_FIELD_USAGE, &root)) {
+        return;
+    }
+    node->inodes = inode_set_new();
+    for (int i = 0; i < dir->order_count; i++) {
+        uint32_t index = dir->order[i];
+        if (dir->attributes[index] & XP_HARDLINKED) {
+            inode_set_claim(node->inodes, dir->devices[index], dir->inodes[index], (uint32_t)i, dir->sizes[index]);
+            dir->sizes[index] = 0;
+        } else if (!dot_directory(dir, index) && usage_subdirectory(dir, index, root.device)) {
+            push_usage_task(worker, node, dir->path, xp_file_name(dir, index), &dir->sizes[index], root.device,
+                            (uint32_t)i);
+        }
+    }
+
+    for (;;) {
+        xt_mutex_lock(&scheduler.mutex);
+        bool joined = node->pending == 0;
+        xt_mutex_unlock(&scheduler.mutex);
+        if (joined) break;
+
+        dir_node *task = scheduler_try_take(worker);
+        if (task) {
+            run_task(worker, task);
+            continue;
+        }
+        xt_mutex_lock(&scheduler.mutex);
+        if (node->pending > 0 && scheduler.queued <= 0) {
+            xt_cond_wait(&scheduler.work_cond, &scheduler.mutex);
+        }
+        xt_mutex_unlock(&scheduler.mutex);
+    }
+    inode_set_charge(node->inodes, dir);
+    inode_set_free(node->inodes);
+    node->inodes = NULL;
+}
+
+// NOTE: -D lists like everything else, except the totals follow the listing order for hard links.
+// -S only has an order once the totals are in, so it hands them out in name order.
+bool list_directory_usage(int worker, dir_node *node, xp_directory *dir) {
+    if (!xp_directory_scan_filtered(node->path, dir, directory_scan_fields(), scan_filter(), NULL)) {
+        return false;
+    }
+    filter_directory_files(dir);
+    if (!unsorted) {
+        sort_directory_files(dir, sort_file_type == SORT_SIZE ? SORT_NAME : sort_file_type);
+    }
+    usage_totals(worker, node, dir);
+    if (!unsorted && sort_file_type == SORT_SIZE) {
+        sort_directory_files(dir, sort_file_type);
+    }
+    if (limit_count > 0 && dir->order_count > limit_count) {
+        dir->order_count = limit_count;
+    }
+    return true;
+}
+
+// NOTE: children are pushed last to first, so the owner continues depth first in listing order
+void walk_directory(int worker, dir_node *node) {
+    if (node->owner) {
+        usage_directory(worker, node);
+        return;
+    }
+
+    xp_directory dir = {0};
+    bool listed = false;
+    if (snapshot_file || diff_file) {
+        listed = snapshot_list(node->path, &dir);
+    } else if (disk_usage) {
+        listed = list_directory_usage(worker, node, &dir);
+    } else {
+        listed = list_directory(node->path, &dir);
+    }
+    if (!listed) {
+        // NOTE: dir.path is node->path when realpath failed, otherwise the resolved path is ours
+        if (dir.path.data != node->path.data) xp_path_free(&dir.path);
+        node->failed = true;
+        return;
+    }
+    uint32_t *old_children = NULL;
+    if (diff_file) {
+        old_children = diff_directory(node, &dir);
+    } else if (!snapshot_file) {
+        print_directory(&node->out, &dir);
+    }
+    if (!recursive) {
+        xp_directory_free(&dir);
+        return;
+    }
+
+    for (int i = 0; i < dir.order_count; i++) {
+        if (subdirectory(&dir, dir.order[i])) node->child_count++;
+    }
+    node->children = malloc((node->child_count ? node->child_count : 1) * sizeof(dir_node *));
+    int child = 0;
+    for (int i = 0; i < dir.order_count; i++) {
+        uint32_t index = dir.order[i];
+        if (!subdirectory(&dir, index)) continue;
+        xp_path path = xp_path_copy(dir.path);
+        xp_append(&path, xp_file_name(&dir, index));
+        node->children[child] = dir_node_new(path);
+        if (old_children) node->children[child]->old = old_children[index];
+        child++;
+    }
+    for (int i = node->child_count - 1; i >= 0; i--) {
+        scheduler_push(worker, node->children[i]);
+    }
+    free(old_children);
+    if (snapshot_file) {
+        node->listing = malloc(sizeof(xp_directory));
+        *node->listing = dir;
+    } else {
+        xp_directory_free(&dir);
+    }
+}
+
+void run_task(int worker, dir_node *node) {
+    walk_directory(worker, node);
+    bool printed = !node->owner;
+    scheduler_finish(node);
+    // NOTE: nothing waits on subtree tasks themselves, only on their owner's pending count
+    if (!printed) dir_node_free(node);
+}
+
+XT_PROC(walk_worker) {
+    int worker = (int)(intptr_t)data;
+    for (;;) {
+        dir_node *node = scheduler_take(worker);
+        if (!node) break;
+        run_task(worker, node);
+    }
+    XT_PROC_RETURN;
+}
+
+void wait_dir_node(dir_node *node) {
+    xt_mutex_lock(&scheduler.mutex);
+    while (!node->done) {
+        xt_cond_wait(&scheduler.done_cond, &scheduler.mutex);
+    }
+    xt_mutex_unlock(&scheduler.mutex);
+}
+
+// NOTE: workers finish directories in any order, the main thread prints them depth first
+// as they become ready and frees each one once its output is out
+void walk_print(out_buffer *out, dir_node *root, bool *first) {
+    int stack_count = 0;
+    int stack_cap = 64;
+    dir_node **stack = malloc(stack_cap * sizeof(dir_node *));
+    stack[stack_count++] = root;
+
+    while (stack_count > 0) {
+        dir_node *node = stack[--stack_count];
+        wait_dir_node(node);
+
+        if (node->failed) {
+            out_flush(out);
+            fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", node->path.data);
+        } else {
+            if (!*first && !diff_file) out_char(out, '\n');
+            out_write(out, node->out.data, node->out.count);
+            *first = false;
+        }
+
+        if (stack_count + node->child_count > stack_cap) {
+            stack_cap = 2 * (stack_count + node->child_count);
+            stack = realloc(stack, stack_cap * sizeof(dir_node *));
+        }
+        for (int i = node->child_count - 1; i >= 0; i--) {
+            stack[stack_count++] = node->children[i];
+        }
+        dir_node_free(node);
+    }
+    free(stack);
+}
+
+void scheduler_start(int worker_count) {
+    scheduler.worker_count = worker_count;
+    scheduler.deques = calloc(scheduler.worker_count, sizeof(work_deque));
+    xt_mutex_init(&scheduler.mutex);
+    xt_cond_init(&scheduler.work_cond);
+    xt_cond_init(&scheduler.done_cond);
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        xt_mutex_init(&scheduler.deques[i].mutex);
+    }
+}
+
+// NOTE: the roots have to be pushed first, without any threads the calling thread does the whole walk
+void scheduler_run() {
+    scheduler.threads = malloc(scheduler.worker_count * sizeof(xt_thread));
+    scheduler.thread_count = 0;
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        if (xt_thread_create(&scheduler.threads[scheduler.thread_count], walk_worker, (void *)(intptr_t)i)) {
+            scheduler.thread_count++;
+        }
+    }
+    if (scheduler.thread_count == 0) {
+        walk_worker((void *)(intptr_t)0);
+    }
+}
+
+void scheduler_stop() {
+    for (int i = 0; i < scheduler.thread_count; i++) {
+        xt_thread_join(scheduler.threads[i]);
+    }
+    free(scheduler.threads);
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        xt_mutex_destroy(&scheduler.deques[i].mutex);
+        free(scheduler.deques[i].items);
+    }
+    free(scheduler.deques);
+    xt_cond_destroy(&scheduler.done_cond);
+    xt_cond_destroy(&scheduler.work_cond);
+    xt_mutex_destroy(&scheduler.mutex);
+}
+
+int walk_worker_count() {
+    return MAX(4, MIN(64, 2 * xt_cpu_count()));
+}
+
+// NOTE: every path argument becomes a root node, so all of them are scanned at once
+// and a slow path only holds back the output that comes after it
+void walk_paths(out_buffer *out, xp_path *paths, int count) {
+    scheduler_start(recursive || disk_usage ? walk_worker_count() : MIN(64, count));
+    dir_node **roots = malloc(count * sizeof(dir_node *));
+    for (int i = count - 1; i >= 0; i--) {
+        roots[i] = dir_node_new(xp_path_copy(paths[i]));
+        scheduler_push(0, roots[i]);
+    }
+    scheduler_run();
+
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        walk_print(out, roots[i], &first);
+    }
+    free(roots);
+    scheduler_stop();
+}
+
+// NOTE: --snapshot saves a whole tree, --diff compares one with the tree as it is now or with a later snapshot
+#define SNAPSHOT_MAGIC   0x50414e53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE    UINT32_MAX
+// NOTE: what has to stay the same for an entry to be unchanged, besides its size and time
+#define SNAPSHOT_TYPE    (XP_NORMAL | XP_DIRECTORY | XP_LINK)
+
+// NOTE: a snapshot is this header, the root path, the directories depth first, then one column
+// per entry field widest first, with every directory's entries consecutive and in name order, then the names
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint64_t names_size;
+    uint32_t dir_count;
+    uint32_t entry_count;
+    uint32_t path_length;
+    uint32_t reserved;
+} snapshot_header;
+
+typedef struct {
+    uint64_t hash; // of everything below the directory, equal hashes mean equal subtrees
+    uint32_t first;
+    uint32_t count;
+} snapshot_dir;
+
+typedef struct {
+    char *image; // the loaded file, the columns point into it
+    char *path;
+    snapshot_dir *dirs;
+    uint64_t *sizes;
+    uint64_t *times;
+    uint32_t *name_offsets;
+    uint32_t *attributes;
+    uint32_t *children; // directory of a subdirectory entry, SNAPSHOT_NONE for everything else
+    uint16_t *name_lengths;
+    char *names;
+    uint32_t dir_count;
+    uint32_t entry_count;
+    uint64_t names_size;
+    uint32_t dir_cap;
+    uint32_t entry_cap;
+    uint64_t names_cap;
+
+    // NOTE: 0, 1, 2... as long as the largest directory, the order of every directory view
+    uint32_t *identity;
+    uint32_t largest;
+} snapshot;
+
+typedef struct {
+    size_t path;
+    size_t dirs;
+    size_t sizes;
+    size_t times;
+    size_t name_offsets;
+    size_t attributes;
+    size_t children;
+    size_t name_lengths;
+    size_t names;
+    size_t end;
+} snapshot_layout;
+
+static snapshot diff_snapshot;
+static int diff_root_length = 0;
+
+snapshot_layout snapshot_layout_of(uint32_t dir_count, uint32_t entry_count, uint32_t path_length, uint64_t names_size) {
+    snapshot_layout layout;
+    layout.path = sizeof(snapshot_header);
+    layout.dirs = (layout.path + path_length + 1 + 7) & ~(size_t)7;
+    layout.sizes = layout.dirs + dir_count * sizeof(snapshot_dir);
+    layout.times = layout.sizes + entry_count * sizeof(uint64_t);
+    layout.name_offsets = layout.times + entry_count * sizeof(uint64_t);
+    layout.attributes = layout.name_offsets + entry_count * sizeof(uint32_t);
+    layout.children = layout.attributes + entry_count * sizeof(uint32_t);
+    layout.name_lengths = layout.children + entry_count * sizeof(uint32_t);
+    layout.names = layout.name_lengths + entry_count * sizeof(uint16_t);
+    layout.end = layout.names + names_size;
+    return layout;
+}
+
+bool snapshot_tree(uint32_t attributes) {
+    return (attributes & XP_DIRECTORY) && !(attributes & XP_LINK);
+}
+
+void snapshot_identity(snapshot *snap, uint32_t count) {
+    if (count <= snap->largest && snap->identity) return;
+    snap->largest = MAX(count, snap->largest);
+    snap->identity = realloc(snap->identity, MAX(1, snap->largest) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < snap->largest; i++) {
+        snap->identity[i] = i;
+    }
+}
+
+// NOTE: a directory of the snapshot as an xp_directory, so it compares and sorts like a scanned one.
+// The view borrows everything and is never freed.
+void snapshot_view(snapshot *snap, uint32_t index, xp_directory *view) {
+    memset(view, 0, sizeof(xp_directory));
+    if (index == SNAPSHOT_NONE) return;
+    snapshot_dir *dir = &snap->dirs[index];
+    view->fields = XP_FIELD_SIZE | XP_FIELD_TIME | XP_FIELD_TYPE;
+    view->file_count = view->file_cap = view->order_count = (int)dir->count;
+    view->sizes = snap->sizes + dir->first;
+    view->times = snap->times + dir->first;
+    view->name_offsets = snap->name_offsets + dir->first;
+    view->attributes = snap->attributes + dir->first;
+    view->name_lengths = snap->name_lengths + dir->first;
+    view->names.data = snap->names;
+    view->names.used = view->names.size = snap->names_size;
+    view->order = snap->identity;
+}
+
+uint32_t snapshot_add_dir(snapshot *snap) {
+    if (snap->dir_count == snap->dir_cap) {
+        snap->dir_cap = snap->dir_cap ? snap->dir_cap * 2 : 1024;
+        snap->dirs = realloc(snap->dirs, snap->dir_cap * sizeof(snapshot_dir));
+    }
+    snapshot_dir *dir = &snap->dirs[snap->dir_count];
+    dir->hash = 0;
+    dir->first = snap->entry_count;
+    dir->count = 0;
+    return snap->dir_count++;
+}
+
+// NOTE: appends the entries of dir in its order to the last directory added
+void snapshot_add_entries(snapshot *snap, const xp_directory *dir) {
+    uint32_t count = (uint32_t)dir->order_count;
+    if (snap->entry_count + count > snap->entry_cap) {
+        snap->entry_cap = MAX(snap->entry_cap * 2, snap->entry_count + count);
+        snap->sizes = realloc(snap->sizes, snap->entry_cap * sizeof(uint64_t));
+        snap->times = realloc(snap->times, snap->entry_cap * sizeof(uint64_t));
+        snap->name_offsets = realloc(snap->name_offsets, snap->entry_cap * sizeof(uint32_t));
+        snap->attributes = realloc(snap->attributes, snap->entry_cap * sizeof(uint32_t));
+        snap->children = realloc(snap->children, snap->entry_cap * sizeof(uint32_t));
+        snap->name_lengths = realloc(snap->name_lengths, snap->entry_cap * sizeof(uint16_t));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = dir->order[i];
+        uint32_t entry = snap->entry_count++;
+        int length = dir->name_lengths[index];
+        if (snap->names_size + length + 1 > snap->names_cap) {
+            snap->names_cap = MAX(snap->names_cap * 2, 64 * 1024);
+            snap->names = realloc(snap->names, snap->names_cap);
+        }
+        snap->sizes[entry] = dir->sizes[index];
+        snap->times[entry] = dir->times[index];
+        snap->name_offsets[entry] = (uint32_t)snap->names_size;
+        snap->attributes[entry] = dir->attributes[index];
+        snap->children[entry] = SNAPSHOT_NONE;
+        snap->name_lengths[entry] = (uint16_t)length;
+        memcpy(snap->names + snap->names_size, xp_file_name(dir, index), length + 1);
+        snap->names_size += length + 1;
+    }
+    snap->dirs[snap->dir_count - 1].count = count;
+    snapshot_identity(snap, count);
+}
+
+// NOTE: children come after their parent, so going backwards every subdirectory is hashed before it is needed.
+// Directory entries stand for their subtree, their own size and time change with any entry added or removed.
+void snapshot_hash(snapshot *snap) {
+    for (uint32_t d = snap->dir_count; d-- > 0;) {
+        snapshot_dir *dir = &snap->dirs[d];
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (uint32_t entry = dir->first; entry < dir->first + dir->count; entry++) {
+            uint64_t fields[3] = {snap->attributes[entry] & SNAPSHOT_TYPE, snap->sizes[entry], snap->times[entry]};
+            if (snap->children[entry] != SNAPSHOT_NONE) {
+                fields[1] = snap->dirs[snap->children[entry]].hash;
+                fields[2] = 0;
+            }
+            hash = fnv_hash(hash, snap->names + snap->name_offsets[entry], snap->name_lengths[entry] + 1);
+            hash = fnv_hash(hash, fields, sizeof(fields));
+        }
+        dir->hash = hash;
+    }
+}
+
+void snapshot_free(snapshot *snap) {
+    if (snap->image) {
+        free(snap->image);
+    } else {
+        free(snap->path);
+        free(snap->dirs);
+        free(snap->sizes);
+        free(snap->times);
+        free(snap->name_offsets);
+        free(snap->attributes);
+        free(snap->children);
+        free(snap->name_lengths);
+        free(snap->names);
+    }
+    free(snap->identity);
+    memset(snap, 0, sizeof(snapshot));
+}
+
+bool snapshot_write(FILE *file, const void *data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+// NOTE: writes to a temporary file next to file_name and renames it over like xp_directory_save,
+// so a failed save leaves the previous snapshot whole
+bool snapshot_save(snapshot *snap, char *file_name) {
+    uint32_t path_length = (uint32_t)strlen(snap->path);
+    snapshot_layout layout = snapshot_layout_of(snap->dir_count, snap->entry_count, path_length, snap->names_size);
+    snapshot_header header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.file_size = layout.end;
+    header.names_size = snap->names_size;
+    header.dir_count = snap->dir_count;
+    header.entry_count = snap->entry_count;
+    header.path_length = path_length;
+
+    size_t name_length = strlen(file_name);
+    char *temp_name = malloc(name_length + 8);
+    memcpy(temp_name, file_name, name_length);
+    strcpy(temp_name + name_length, ".XXXXXX");
+#ifdef _WIN32
+    FILE *file = _mktemp_s(temp_name, name_length + 8) == 0 ? fopen(temp_name, "wb") : NULL;
+#else
+    int fd = mkstemp(temp_name);
+    FILE *file = fd != -1 ? fdopen(fd, "wb") : NULL;
+    if (fd != -1 && !file) {
+        close(fd);
+        unlink(temp_name);
+    }
+#endif
+    if (!file) {
+        free(temp_name);
+        return false;
+    }
+    static const char padding[8] = {0};
+    uint32_t count = snap->entry_count;
+    bool saved = snapshot_write(file, &header, sizeof(header));
+    saved = saved && snapshot_write(file, snap->path, path_length);
+    saved = saved && snapshot_write(file, padding, layout.dirs - layout.path - path_length);
+    saved = saved && snapshot_write(file, snap->dirs, snap->dir_count * sizeof(snapshot_dir));
+    saved = saved && snapshot_write(file, snap->sizes, count * sizeof(uint64_t));
+    saved = saved && snapshot_write(file, snap->times, count * sizeof(uint64_t));
+    saved = saved && snapshot_write(file, snap->name_offsets, count * sizeof(uint32_t));
+    saved = saved && snapshot_write(file, snap->attributes, count * sizeof(uint32_t));
+    saved = saved && snapshot_write(file, snap->children, count * sizeof(uint32_t));
+    saved = saved && snapshot_write(file, snap->name_lengths, count * sizeof(uint16_t));
+    saved = saved && snapshot_write(file, snap->names, snap->names_size);
+    saved = (fclose(file) == 0) && saved;
+#ifdef _WIN32
+    saved = saved && MoveFileExA(temp_name, file_name, MOVEFILE_REPLACE_EXISTING);
+#else
+    saved = saved && rename(temp_name, file_name) == 0;
+#endif
+    if (!saved) remove(temp_name);
+    free(temp_name);
+    return saved;
+}
+
+// NOTE: reads a whole snapshot and checks every index in it, false for anything that is not one
+bool snapshot_load(snapshot *snap, char *file_name) {
+    memset(snap, 0, sizeof(snapshot));
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        return false;
+    }
+    snapshot_header header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1;
+    valid = valid && header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION;
+    snapshot_layout layout = {0};
+    if (valid) {
+        layout = snapshot_layout_of(header.dir_count, header.entry_count, header.path_length, header.names_size);
+        valid = layout.end == header.file_size && header.dir_count > 0;
+    }
+    if (valid) {
+        snap->image = malloc(layout.end);
+        valid = snap->image && fseek(file, 0, SEEK_SET) == 0 && fread(snap->image, layout.end, 1, file) == 1;
+    }
+    fclose(file);
+    if (!valid) {
+        free(snap->image);
+        snap->image = NULL;
+        return false;
+    }
+
+    char *image = snap->image;
+    snap->path = image + layout.path;
+    snap->dirs = (snapshot_dir *)(image + layout.dirs);
+    snap->sizes = (uint64_t *)(image + layout.sizes);
+    snap->times = (uint64_t *)(image + layout.times);
+    snap->name_offsets = (uint32_t *)(image + layout.name_offsets);
+    snap->attributes = (uint32_t *)(image + layout.attributes);
+    snap->children = (uint32_t *)(image + layout.children);
+    snap->name_lengths = (uint16_t *)(image + layout.name_lengths);
+    snap->names = image + layout.names;
+    snap->dir_count = header.dir_count;
+    snap->entry_count = header.entry_count;
+    snap->names_size = header.names_size;
+    valid = snap->path[header.path_length] == '\0';
+
+    // NOTE: directories are saved depth first, so every child comes after its parent. Anything else
+    // could send the diff around in a loop.
+    for (uint32_t d = 0; valid && d < snap->dir_count; d++) {
+        snapshot_dir *dir = &snap->dirs[d];
+        valid = dir->first <= snap->entry_count && dir->count <= snap->entry_count - dir->first;
+        if (valid) snapshot_identity(snap, dir->count);
+        for (uint32_t entry = dir->first; valid && entry < dir->first + dir->count; entry++) {
+            uint32_t child = snap->children[entry];
+            valid = child == SNAPSHOT_NONE || child > d;
+        }
+    }
+    for (uint32_t entry = 0; valid && entry < snap->entry_count; entry++) {
+        uint32_t child = snap->children[entry];
+        uint64_t end = (uint64_t)snap->name_offsets[entry] + snap->name_lengths[entry];
+        valid = (child == SNAPSHOT_NONE || child < snap->dir_count) && end < snap->names_size && snap->names[end] == '\0';
+    }
+    if (!valid) {
+        snapshot_free(snap);
+    }
+    return valid;
+}
+
+// NOTE: snapshots and diffs keep hidden entries and leave out only what the matcher rejects, in name order
+bool snapshot_list(xp_path path, xp_directory *dir) {
+    if (!xp_directory_scan_filtered(path, dir, XP_FIELD_SIZE | XP_FIELD_TIME | XP_FIELD_TYPE, scan_filter(), NULL)) {
+        return false;
+    }
+    int order_count = 0;
+    for (int i = 0; i < dir->order_count; i++) {
+        uint32_t index = dir->order[i];
+        if (!dot_directory(dir, index) && file_matches(dir, index)) {
+            dir->order[order_count++] = index;
+        }
+    }
+    dir->order_count = order_count;
+    sort_files_by_name(dir, dir->order, dir->order_count);
+    return true;
+}
+
+// NOTE: the workers scan, the main thread takes directories in the order they are saved, depth first
+void snapshot_collect(snapshot *snap, dir_node *root) {
+    int stack_count = 0;
+    int stack_cap = 64;
+    dir_node **stack = malloc(stack_cap * sizeof(dir_node *));
+    uint32_t *parents = malloc(stack_cap * sizeof(uint32_t));
+    stack[stack_count] = root;
+    parents[stack_count++] = SNAPSHOT_NONE;
+
+    while (stack_count > 0) {
+        dir_node *node = stack[--stack_count];
+        uint32_t parent = parents[stack_count];
+        wait_dir_node(node);
+
+        uint32_t index = snapshot_add_dir(snap);
+        if (parent != SNAPSHOT_NONE) snap->children[parent] = index;
+        if (node->failed) {
+            fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", node->path.data);
+            dir_node_free(node);
+            continue;
+        }
+
+        xp_directory *dir = node->listing;
+        uint32_t first = snap->entry_count;
+        snapshot_add_entries(snap, dir);
+        if (stack_count + node->child_count > stack_cap) {
+            stack_cap = 2 * (stack_count + node->child_count);
+            stack = realloc(stack, stack_cap * sizeof(dir_node *));
+            parents = realloc(parents, stack_cap * sizeof(uint32_t));
+        }
+        // NOTE: the subdirectories of the listing line up with the node's children
+        int child = node->child_count;
+        for (int i = dir->order_count - 1; i >= 0; i--) {
+            if (!subdirectory(dir, dir->order[i])) continue;
+            stack[stack_count] = node->children[--child];
+            parents[stack_count++] = first + i;
+        }
+        dir_node_free(node);
+    }
+    free(parents);
+    free(stack);
+}
+
+bool run_snapshot(xp_path path) {
+    snapshot snap = {0};
+    snap.path = malloc(path.count + 1);
+    memcpy(snap.path, path.data, path.count);
+    snap.path[path.count] = '\0';
+
+    scheduler_start(walk_worker_count());
+    dir_node *root = dir_node_new(xp_path_copy(path));
+    scheduler_push(0, root);
+    scheduler_run();
+    snapshot_collect(&snap, root);
+    scheduler_stop();
+
+    snapshot_hash(&snap);
+    bool saved = snapshot_save(&snap, snapshot_file);
+    if (!saved) {
+        fprintf(stderr, "Lister: failed to write snapshot '%s'\n", snapshot_file);
+    }
+    snapshot_free(&snap);
+    return saved;
+}
+
+// NOTE: one changed entry, "+ added", "- removed" or "M modified", directories end in '/'
+void diff_line(out_buffer *out, char mark, char *relative, char *name, int length, bool tree) {
+    out_char(out, mark);
+    out_char(out, ' ');
+    if (*relative) {
+        out_string(out, relative);
+        out_char(out, '/');
+    }
+    out_write(out, name, length);
+    if (tree) out_char(out, '/');
+    out_char(out, '\n');
+}
+
+char *diff_child_relative(char *relative, char *name, int length) {
+    int relative_length = (int)strlen(relative);
+    char *child = malloc(relative_length + length + 2);
+    memcpy(child, relative, relative_length);
+    if (relative_length) child[relative_length++] = '/';
+    memcpy(child + relative_length, name, length + 1);
+    return child;
+}
+
+// NOTE: everything below a directory of the snapshot, entries before their contents
+void diff_subtree(out_buffer *out, char mark, snapshot *snap, uint32_t index, char *relative) {
+    snapshot_dir *dir = &snap->dirs[index];
+    for (uint32_t entry = dir->first; entry < dir->first + dir->count; entry++) {
+        char *name = snap->names + snap->name_offsets[entry];
+        int length = snap->name_lengths[entry];
+        uint32_t child = snap->children[entry];
+        diff_line(out, mark, relative, name, length, child != SNAPSHOT_NONE);
+        if (child != SNAPSHOT_NONE) {
+            char *child_relative = diff_child_relative(relative, name, length);
+            diff_subtree(out, mark, snap, child, child_relative);
+            free(child_relative);
+        }
+    }
+}
+
+bool diff_entry_changed(const xp_directory *dir1, uint32_t file1, const xp_directory *dir2, uint32_t file2) {
+    if ((dir1->attributes[file1] & SNAPSHOT_TYPE) != (dir2->attributes[file2] & SNAPSHOT_TYPE)) return true;
+    return dir1->sizes[file1] != dir2->sizes[file2] || dir1->times[file1] != dir2->times[file2];
+}
+
+// NOTE: merges directory old_index of the snapshot with dir, both in name order. Removed subtrees are
+// written out right away, the returned array says which snapshot directory each subdirectory of dir
+// continues in (SNAPSHOT_NONE for new ones) so its contents can be compared after this directory.
+uint32_t *diff_entries(out_buffer *out, char *relative, snapshot *old_snap, uint32_t old_index, const xp_directory *dir) {
+    xp_directory old;
+    snapshot_view(old_snap, old_index, &old);
+    uint32_t first = old_index == SNAPSHOT_NONE ? 0 : old_snap->dirs[old_index].first;
+    uint32_t *old_children = malloc(MAX(1, dir->file_count) * sizeof(uint32_t));
+
+    int i = 0;
+    int j = 0;
+    while (i < dir->order_count || j < old.file_count) {
+        uint32_t index = i < dir->order_count ? dir->order[i] : 0;
+        int compare = 0;
+        if (i == dir->order_count) compare = 1;
+        else if (j == old.file_count) compare = -1;
+        else compare = compare_file_name(dir, index, &old, j);
+
+        bool old_tree = compare >= 0 && old_snap->children[first + j] != SNAPSHOT_NONE;
+        bool tree = compare <= 0 && snapshot_tree(dir->attributes[index]);
+        bool removed = compare > 0 || (compare == 0 && tree != old_tree);
+        if (removed) {
+            diff_line(out, '-', relative, xp_file_name(&old, j), old.name_lengths[j], old_tree);
+            if (old_tree) {
+                char *child_relative = diff_child_relative(relative, xp_file_name(&old, j), old.name_lengths[j]);
+                diff_subtree(out, '-', old_snap, old_snap->children[first + j], child_relative);
+                free(child_relative);
+            }
+        }
+        if (compare <= 0) {
+            old_children[index] = SNAPSHOT_NONE;
+            if (compare < 0 || removed) {
+                diff_line(out, '+', relative, xp_file_name(dir, index), dir->name_lengths[index], tree);
+            } else if (tree) {
+                old_children[index] = old_snap->children[first + j];
+            } else if (diff_entry_changed(dir, index, &old, j)) {
+                diff_line(out, 'M', relative, xp_file_name(dir, index), dir->name_lengths[index], false);
+            }
+            i++;
+        }
+        if (compare >= 0) j++;
+    }
+    return old_children;
+}
+
+// NOTE: a worker's part of a --diff against the tree as it is now
+uint32_t *diff_directory(dir_node *node, xp_directory *dir) {
+    char *relative = (char *)node->path.data + diff_root_length;
+    if (*relative == '/') relative++;
+    return diff_entries(&node->out, relative, &diff_snapshot, node->old, dir);
+}
+
+// NOTE: a --diff between two snapshots never looks inside a subtree whose hash is unchanged
+void diff_snapshots(out_buffer *out, snapshot *old_snap, uint32_t old_index, snapshot *snap, uint32_t index, char *relative) {
+    if (old_index != SNAPSHOT_NONE && old_snap->dirs[old_index].hash == snap->dirs[index].hash) {
+        return;
+    }
+    xp_directory dir;
+    snapshot_view(snap, index, &dir);
+    uint32_t *old_children = diff_entries(out, relative, old_snap, old_index, &dir);
+    uint32_t first = snap->dirs[index].first;
+    for (int i = 0; i < dir.file_count; i++) {
+        uint32_t child = snap->children[first + i];
+        if (child == SNAPSHOT_NONE) continue;
+        char *child_relative = diff_child_relative(relative, xp_file_name(&dir, i), dir.name_lengths[i]);
+        diff_snapshots(out, old_snap, old_children[i], snap, child, child_relative);
+        free(child_relative);
+    }
+    free(old_children);
+}
+
+// NOTE: path is the tree to compare with, or a later snapshot of it
+bool run_diff(out_buffer *out, xp_path path) {
+    if (!snapshot_load(&diff_snapshot, diff_file)) {
+        fprintf(stderr, "Lister: failed to read snapshot '%s'\n", diff_file);
+        return false;
+    }
+
+    snapshot later;
+    if (snapshot_load(&later, (char *)path.data)) {
+        diff_snapshots(out, &diff_snapshot, 0, &later, 0, "");
+        snapshot_free(&later);
+    } else {
+        diff_root_length = path.count;
+        scheduler_start(walk_worker_count());
+        dir_node *root = dir_node_new(xp_path_copy(path));
+        root->old = 0;
+        scheduler_push(0, root);
+        scheduler_run();
+        bool first = true;
+        walk_print(out, root, &first);
+        scheduler_stop();
+    }
+    snapshot_free(&diff_snapshot);
+    return true;
+}
+
+#ifdef __linux__
+// NOTE: name -> entry of a watched directory, so an event finds its entry without a scan.
+// Slots hold index + 1, 0 is empty and WATCH_TOMBSTONE a removed name.
+#define WATCH_TOMBSTONE UINT32_MAX
+
+typedef struct {
+    uint32_t *slots;
+    int count;
+    int used;
+    int cap;
+} name_table;
+
+typedef struct {
+    xp_directory dir;
+    // NOTE: borrowed, and not held open, an open directory only reports IN_DELETE_SELF once closed
+    xp_path path;
+    uint32_t fields;
+    name_table names;
+    int order_cap;
+    uint32_t *free_indices;
+    int free_count;
+    int free_cap;
+    int replaced;
+} watch_state;
+
+// NOTE: one rendered screen, kept to redraw only the rows that differ from the last one
+typedef struct {
+    out_buffer text;
+    int *starts;
+    int *lengths;
+    int count;
+    int cap;
+} watch_frame;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+void watch_signal(int signal) {
+    (void)signal;
+    watch_stop = 1;
+}
+
+uint64_t watch_name_hash(const char *name, int length) {
+    return fnv_hash(0xcbf29ce484222325ull, name, length);
+}
+
+int name_table_find_slot(watch_state *w, const char *name, int length) {
+    name_table *table = &w->names;
+    if (!table->cap) return -1;
+    for (uint64_t slot = watch_name_hash(name, length);; slot++) {
+        uint32_t value = table->slots[slot & (table->cap - 1)];
+        if (value == 0) return -1;
+        if (value == WATCH_TOMBSTONE) continue;
+        uint32_t index = value - 1;
+        if (w->dir.name_lengths[index] == length && memcmp(xp_file_name(&w->dir, index), name, length) == 0) {
+            return (int)(slot & (table->cap - 1));
+        }
+    }
+}
+
+void name_table_add(watch_state *w, uint32_t index);
+
+void name_table_grow(watch_state *w) {
+    name_table *table = &w->names;
+    uint32_t *slots = table->slots;
+    int cap = table->cap;
+    table->cap = 256;
+    while (table->cap < 4 * (table->count + 1)) table->cap *= 2;
+    table->slots = calloc(table->cap, sizeof(uint32_t));
+    table->count = table->used = 0;
+    for (int i = 0; i < cap; i++) {
+        if (slots[i] && slots[i] != WATCH_TOMBSTONE) name_table_add(w, slots[i] - 1);
+    }
+    free(slots);
+}
+
+void name_table_add(watch_state *w, uint32_t index) {
+    name_table *table = &w->names;
+    if (2 * (table->used + 1) > table->cap) {
+        name_table_grow(w);
+    }
+    uint64_t slot = watch_name_hash(xp_file_name(&w->dir, index), w->dir.name_lengths[index]);
+    while (table->slots[slot & (table->cap - 1)] != 0) slot++;
+    table->slots[slot & (table->cap - 1)] = index + 1;
+    table->count++;
+    table->used++;
+}
+
+// NOTE: where index goes in the listing order, or where it is when it is already there
+int watch_order_position(watch_state *w, uint32_t index) {
+    xp_directory *dir = &w->dir;
+    if (unsorted) {
+        for (int i = 0; i < dir->order_count; i++) {
+            if (dir->order[i] == index) return i;
+        }
+        return dir->order_count;
+    }
+    int low = 0;
+    int high = dir->order_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (compare_files(dir, dir->order[mid], dir, index, sort_file_type) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+void watch_remove(watch_state *w, const char *name) {
+    int slot = name_table_find_slot(w, name, (int)strlen(name));
+    if (slot < 0) return;
+    uint32_t index = w->names.slots[slot] - 1;
+    xp_directory *dir = &w->dir;
+
+    int position = watch_order_position(w, index);
+    if (position < dir->order_count && dir->order[position] == index) {
+        memmove(dir->order + position, dir->order + position + 1, (dir->order_count - position - 1) * sizeof(uint32_t));
+        dir->order_count--;
+    }
+    w->names.slots[slot] = WATCH_TOMBSTONE;
+    w->names.count--;
+
+    if (w->free_count == w->free_cap) {
+        w->free_cap = w->free_cap ? w->free_cap * 2 : 64;
+        w->free_indices = realloc(w->free_indices, w->free_cap * sizeof(uint32_t));
+    }
+    w->free_indices[w->free_count++] = index;
+}
+
+// NOTE: (re)adds name with fresh metadata, entries removed earlier are reused so the columns stay dense
+void watch_insert(watch_state *w, char *name) {
+    watch_remove(w, name);
+    xp_file file = {0};
+    xp_path file_path = xp_path_copy(w->path);
+    xp_append(&file_path, name);
+    // NOTE: there is no d_type to take the link bit from, so the entry itself is stat'd first
+    // and a link is then followed like the scan follows it
+    bool found = xp_stat_at_flags(AT_FDCWD, (char *)file_path.data, w->fields, AT_SYMLINK_NOFOLLOW, &file);
+    if (found && (file.attributes & XP_LINK) && !(xp_stat_flags(w->fields) & AT_SYMLINK_NOFOLLOW)) {
+        xp_stat_at(AT_FDCWD, (char *)file_path.data, w->fields, &file);
+        file.attributes |= XP_LINK;
+    }
+    xp_path_free(&file_path);
+    if (!found) {
+        return;
+    }
+    xp_directory *dir = &w->dir;
+    uint32_t index;
+    if (w->free_count > 0) {
+        index = w->free_indices[--w->free_count];
+        xp_file_replace(dir, index, name, &file);
+        if (++w->replaced > dir->file_count) {
+            xp_directory_compact_names(dir);
+            w->replaced = 0;
+        }
+    } else {
+        index = xp_file_push(dir, name, &file);
+    }
+    name_table_add(w, index);
+
+    if (!file_interesting(dir, index)) return;
+    if (dir->order_count == w->order_cap) {
+        w->order_cap *= 2;
+        dir->order = realloc(dir->order, w->order_cap * sizeof(uint32_t));
+    }
+    int position = watch_order_position(w, index);
+    memmove(dir->order + position + 1, dir->order + position, (dir->order_count - position) * sizeof(uint32_t));
+    dir->order[position] = index;
+    dir->order_count++;
+}
+
+void watch_state_free(watch_state *w) {
+    xp_directory_free(&w->dir);
+    free(w->names.slots);
+    free(w->free_indices);
+    memset(&w->names, 0, sizeof(name_table));
+    w->free_indices = NULL;
+    w->free_count = w->free_cap = w->replaced = 0;
+}
+
+// NOTE: the one full scan, also used to start over when inotify drops events
+bool watch_scan(watch_state *w, xp_path path) {
+    watch_state_free(w);
+    if (!xp_directory_scan_filtered(path, &w->dir, w->fields, scan_filter(), NULL)) {
+        return false;
+    }
+    filter_directory_files(&w->dir);
+    if (!unsorted) {
+        sort_directory_files(&w->dir, sort_file_type);
+    }
+    w->order_cap = w->dir.file_count ? w->dir.file_count : 1;
+    for (int i = 0; i < w->dir.file_count; i++) {
+        name_table_add(w, i);
+    }
+    return true;
+}
+
+void watch_frame_split(watch_frame *frame, int max_lines) {
+    frame->count = 0;
+    for (int start = 0; start < frame->text.count && frame->count < max_lines;) {
+        char *end = memchr(frame->text.data + start, '\n', frame->text.count - start);
+        int length = end ? (int)(end - (frame->text.data + start)) : frame->text.count - start;
+        if (frame->count == frame->cap) {
+            frame->cap = frame->cap ? frame->cap * 2 : 64;
+            frame->starts = realloc(frame->starts, frame->cap * sizeof(int));
+            frame->lengths = realloc(frame->lengths, frame->cap * sizeof(int));
+        }
+        frame->starts[frame->count] = start;
+        frame->lengths[frame->count] = length;
+        frame->count++;
+        start += length + 1;
+    }
+}
+
+// NOTE: only the rows that fit on screen are rendered
+void watch_render(watch_state *w, watch_frame *frame, int rows) {
+    xp_directory view = w->dir;
+    if (limit_count > 0) view.order_count = MIN(view.order_count, limit_count);
+    frame->text.count = 0;
+    if (print_dir_name) {
+        print_directory_name(&frame->text, view.path);
+    }
+    if (print_format == FORMAT_LONG) {
+        view.order_count = MIN(view.order_count, rows);
+        print_long_format(&frame->text, &view);
+    } else {
+        print_wide_rows(&frame->text, &view, rows);
+    }
+    watch_frame_split(frame, rows);
+}
+
+// NOTE: moves the cursor to each row that changed and rewrites just that row
+void watch_draw(out_buffer *out, watch_frame *frame, watch_frame *last) {
+    for (int row = 0; row < MAX(frame->count, last->count); row++) {
+        bool fresh = row < frame->count;
+        if (fresh && row < last->count && frame->lengths[row] == last->lengths[row] &&
+            memcmp(frame->text.data + frame->starts[row], last->text.data + last->starts[row], frame->lengths[row]) == 0) {
+            continue;
+        }
+        out_string(out, "\x1b[");
+        out_uint(out, row + 1, 0, ' ');
+        out_string(out, ";1H");
+        if (fresh) out_write(out, frame->text.data + frame->starts[row], frame->lengths[row]);
+        out_string(out, "\x1b[K");
+    }
+    out_flush(out);
+}
+
+void watch_frame_free(watch_frame *frame) {
+    free(frame->text.data);
+    free(frame->starts);
+    free(frame->lengths);
+}
+
+// NOTE: false when the directory itself went away
+bool watch_event(watch_state *w, xp_path path, struct inotify_event *event) {
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        return false;
+    }
+    if (event->mask & IN_Q_OVERFLOW) {
+        return watch_scan(w, path);
+    }
+    if (!event->len) return true;
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watch_remove(w, event->name);
+    } else {
+        watch_insert(w, event->name);
+    }
+    return true;
+}
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | \
+    IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// NOTE: applies one buffer of events, false when the directory itself went away
+bool watch_apply(watch_state *w, xp_path path, char *buffer, ssize_t size) {
+    for (char *ptr = buffer; ptr < buffer + size;) {
+        struct inotify_event *event = (struct inotify_event *)ptr;
+        ptr += sizeof(struct inotify_event) + event->len;
+        if (!watch_event(w, path, event)) return false;
+    }
+    return true;
+}
+
+// NOTE: keeps the listing of path on screen, inotify events are applied to the sorted order in place
+// and only rows that changed are redrawn. Bursts of events within WATCH_SETTLE_MS go out as one redraw.
+#define WATCH_SETTLE_MS 20
+
+bool watch_directory(out_buffer *out, xp_path path) {
+    watch_state w = {0};
+    w.fields = directory_scan_fields();
+    w.path = path;
+    int notify_fd = inotify_init1(IN_CLOEXEC);
+    if (notify_fd == -1 || inotify_add_watch(notify_fd, (char *)path.data, WATCH_EVENTS) == -1 ||
+        !watch_scan(&w, path)) {
+        if (notify_fd != -1) close(notify_fd);
+        watch_state_free(&w);
+        return false;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = watch_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    watch_frame frames[2] = {0};
+    frames[0].text.fd = frames[1].text.fd = -1;
+    int current = 0;
+    int rows = 0;
+    char *events = malloc(64 * 1024);
+
+    out_string(out, "\x1b[?1049h\x1b[?25l");
+    while (!watch_stop) {
+        struct winsize size;
+        int screen_rows = 24;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+            screen_rows = size.ws_row;
+            if (size.ws_col > 0) line_length = size.ws_col;
+        }
+        if (screen_rows != rows) {
+            // NOTE: the terminal was resized, start from a blank screen
+            rows = screen_rows;
+            frames[current ^ 1].count = 0;
+            out_string(out, "\x1b[H\x1b[2J");
+        }
+        watch_render(&w, &frames[current], rows);
+        watch_draw(out, &frames[current], &frames[current ^ 1]);
+        current ^= 1;
+
+        // NOTE: with nothing happening the screen is still redrawn when a shown time crosses the cutoff
+        int timeout = -1;
+        if (print_format == FORMAT_LONG && time_stale() != INT64_MAX) {
+            int64_t wait = time_stale() - (int64_t)time(NULL);
+            timeout = (int)MAX(0, MIN(wait, 3600)) * 1000;
+        }
+        struct pollfd poll_fd = {notify_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, timeout) <= 0) continue;
+        bool alive = true;
+        do {
+            ssize_t n = read(notify_fd, events, 64 * 1024);
+            if (n <= 0) break;
+            alive = watch_apply(&w, path, events, n);
+        } while (alive && poll(&poll_fd, 1, WATCH_SETTLE_MS) > 0);
+        if (!alive) break;
+    }
+    out_string(out, "\x1b[?25h\x1b[?1049l");
+    out_flush(out);
+
+    free(events);
+    watch_frame_free(&frames[0]);
+    watch_frame_free(&frames[1]);
+    watch_state_free(&w);
+    close(notify_fd);
+    return true;
+}
+#endif
+
+#ifdef __linux__
+// NOTE: --daemon keeps inotify-maintained listings in memory and renders them for --client,
+// one request per path over a Unix socket. Requests carry every option that changes the output.
+#define DAEMON_MAGIC 0x4c53544c // "LTSL"
+#define DAEMON_MAX_LISTINGS 256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t path_length;
+    int32_t print_format;
+    int32_t sort_file_type;
+    int32_t limit_count;
+    int32_t line_length;
+    uint8_t reverse_order;
+    uint8_t all_files;
+    uint8_t unsorted;
+    uint8_t color_output;
+    uint8_t print_dir_name;
+    uint8_t padding[3];
+} daemon_request;
+
+typedef struct {
+    uint32_t listed;
+    uint32_t padding;
+    uint64_t length;
+} daemon_reply;
+
+typedef struct {
+    xp_path path;
+    daemon_request options;
+    watch_state state;
+    int wd;
+    uint64_t last_used;
+
+    // NOTE: the last reply, reused until an event changes the listing or a request prints it differently
+    out_buffer rendered;
+    daemon_request rendered_options;
+    bool rendered_valid;
+    int64_t rendered_stale;
+} daemon_listing;
+
+typedef struct {
+    int fd;
+    char *in;
+    int in_count;
+    int in_cap;
+    out_buffer out;
+    int out_sent;
+} daemon_client;
+
+typedef struct {
+    int notify_fd;
+    daemon_listing *listings[DAEMON_MAX_LISTINGS];
+    int listing_count;
+    uint64_t clock;
+} daemon_state;
+
+// NOTE: $XDG_RUNTIME_DIR/lister.sock, or lister.sock in a per-user directory in /tmp. Anyone can
+// create that directory first, so it is only used when it is ours, not a link and closed to others.
+bool daemon_socket_path(struct sockaddr_un *address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] == '/') {
+        snprintf(address->sun_path, sizeof(address->sun_path), "%s/lister.sock", runtime);
+        return true;
+    }
+    char directory[64];
+    snprintf(directory, sizeof(directory), "/tmp/lister-%u", (unsigned)getuid());
+    mkdir(directory, 0700);
+    struct stat f_stat;
+    if (lstat(directory, &f_stat) != 0 || !S_ISDIR(f_stat.st_mode) || f_stat.st_uid != getuid() ||
+        (f_stat.st_mode & 077) != 0) {
+        fprintf(stderr, "Lister: '%s' is not a private directory\n", directory);
+        return false;
+    }
+    snprintf(address->sun_path, sizeof(address->sun_path), "%s/lister.sock", directory);
+    return true;
+}
+
+// NOTE: the daemon lists with our permissions and the client prints what it is sent, so both ends
+// only talk to the same user
+bool daemon_peer_trusted(int fd) {
+    struct ucred peer;
+    socklen_t size = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 && peer.uid == getuid();
+}
+
+void daemon_request_from_options(daemon_request *request, xp_path path) {
+    memset(request, 0, sizeof(daemon_request));
+    request->magic = DAEMON_MAGIC;
+    request->path_length = path.count;
+    request->print_format = print_format;
+    request->sort_file_type = sort_file_type;
+    request->limit_count = limit_count;
+    request->line_length = line_length;
+    request->reverse_order = reverse_order;
+    request->all_files = all_files;
+    request->unsorted = unsorted;
+    request->color_output = color_output;
+    request->print_dir_name = print_dir_name;
+}
+
+// NOTE: the daemon is single threaded, so it simply takes on the options of whoever it serves
+void daemon_use_options(daemon_request *request) {
+    print_format = request->print_format;
+    sort_file_type = request->sort_file_type;
+    limit_count = request->limit_count;
+    line_length = request->line_length;
+    reverse_order = request->reverse_order;
+    all_files = request->all_files;
+    unsorted = request->unsorted;
+    color_output = request->color_output;
+    print_dir_name = request->print_dir_name;
+}
+
+// NOTE: listings can be shared by requests that only differ in how the entries are printed
+bool daemon_same_listing(daemon_listing *listing, daemon_request *request, char *path) {
+    daemon_request *options = &listing->options;
+    return listing->path.count == (int)request->path_length && memcmp(listing->path.data, path, request->path_length) == 0 &&
+        options->sort_file_type == request->sort_file_type && options->reverse_order == request->reverse_order &&
+        options->all_files == request->all_files && options->unsorted == request->unsorted &&
+        options->color_output == request->color_output && (options->print_format == FORMAT_LONG) == (request->print_format == FORMAT_LONG);
+}
+
+void daemon_listing_free(daemon_state *daemon, int slot) {
+    daemon_listing *listing = daemon->listings[slot];
+    bool shared = false;
+    for (int i = 0; i < daemon->listing_count; i++) {
+        if (i != slot && daemon->listings[i]->wd == listing->wd) shared = true;
+    }
+    if (!shared && listing->wd != -1) inotify_rm_watch(daemon->notify_fd, listing->wd);
+    watch_state_free(&listing->state);
+    free(listing->rendered.data);
+    xp_path_free(&listing->path);
+    free(listing);
+    daemon->listings[slot] = daemon->listings[--daemon->listing_count];
+}
+
+daemon_listing *daemon_listing_new(daemon_state *daemon, daemon_request *request, char *path) {
+    if (daemon->listing_count == DAEMON_MAX_LISTINGS) {
+        int oldest = 0;
+        for (int i = 1; i < daemon->listing_count; i++) {
+            if (daemon->listings[i]->last_used < daemon->listings[oldest]->last_used) oldest = i;
+        }
+        daemon_listing_free(daemon, oldest);
+    }
+
+    daemon_listing *listing = calloc(1, sizeof(daemon_listing));
+    listing->path.data = malloc(request->path_length + 1);
+    memcpy(listing->path.data, path, request->path_length);
+    listing->path.data[request->path_length] = '\0';
+    listing->path.count = request->path_length;
+    listing->options = *request;
+    listing->rendered.fd = -1;
+    listing->state.fields = directory_scan_fields();
+    listing->state.path = listing->path;
+    listing->wd = inotify_add_watch(daemon->notify_fd, (char *)listing->path.data, WATCH_EVENTS);
+    daemon->listings[daemon->listing_count++] = listing;
+
+    if (listing->wd == -1 || !watch_scan(&listing->state, listing->path)) {
+        daemon_listing_free(daemon, daemon->listing_count - 1);
+        return NULL;
+    }
+    return listing;
+}
+
+// NOTE: applies everything inotify has queued, changes made before a request was sent are always
+// queued by the time it is read, so draining first keeps replies current
+void daemon_drain_events(daemon_state *daemon) {
+    static char events[64 * 1024];
+    for (;;) {
+        ssize_t n = read(daemon->notify_fd, events, sizeof(events));
+        if (n <= 0) break;
+        for (char *ptr = events; ptr < events + n;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            for (int i = 0; i < daemon->listing_count; i++) {
+                daemon_listing *listing = daemon->listings[i];
+                if (listing->wd != event->wd && !(event->mask & IN_Q_OVERFLOW)) continue;
+                daemon_use_options(&listing->options);
+                listing->rendered_valid = false;
+                if (!watch_event(&listing->state, listing->path, event)) {
+                    // NOTE: the watch is gone with the directory, a later request starts over
+                    listing->wd = -1;
+                    daemon_listing_free(daemon, i--);
+                }
+            }
+        }
+    }
+}
+
+void daemon_serve(daemon_state *daemon, daemon_client *client, daemon_request *request, char *path) {
+    daemon_drain_events(daemon);
+    daemon_use_options(request);
+
+    daemon_listing *listing = NULL;
+    for (int i = 0; i < daemon->listing_count && !listing; i++) {
+        if (daemon_same_listing(daemon->listings[i], request, path)) listing = daemon->listings[i];
+    }
+    if (!listing) {
+        listing = daemon_listing_new(daemon, request, path);
+    }
+
+    daemon_reply reply = {0};
+    int header = client->out.count;
+    out_write(&client->out, (char *)&reply, sizeof(daemon_reply));
+    if (listing) {
+        listing->last_used = ++daemon->clock;
+        daemon_request *last = &listing->rendered_options;
+        bool same = last->print_format == request->print_format && last->limit_count == request->limit_count &&
+            last->line_length == request->line_length && last->print_dir_name == request->print_dir_name;
+        if (!listing->rendered_valid || !same || (int64_t)time(NULL) >= listing->rendered_stale) {
+            xp_directory view = listing->state.dir;
+            if (limit_count > 0) view.order_count = MIN(view.order_count, limit_count);
+            listing->rendered.count = 0;
+            print_directory(&listing->rendered, &view);
+            listing->rendered_options = *request;
+            listing->rendered_valid = true;
+            listing->rendered_stale = print_format == FORMAT_LONG ? time_stale() : INT64_MAX;
+        }
+        out_write(&client->out, listing->rendered.data, listing->rendered.count);
+        reply.listed = 1;
+        reply.length = listing->rendered.count;
+    }
+    memcpy(client->out.data + header, &reply, sizeof(daemon_reply));
+}
+
+// NOTE: false once the client is gone
+bool daemon_client_read(daemon_state *daemon, daemon_client *client) {
+    for (;;) {
+        if (client->in_cap - client->in_count < 4096) {
+            client->in_cap = client->in_cap ? client->in_cap * 2 : 8192;
+            client->in = realloc(client->in, client->in_cap);
+        }
+        ssize_t n = read(client->fd, client->in + client->in_count, client->in_cap - client->in_count);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            return false;
+        }
+        client->in_count += (int)n;
+    }
+
+    int used = 0;
+    while (client->in_count - used >= (int)sizeof(daemon_request)) {
+        daemon_request request;
+        memcpy(&request, client->in + used, sizeof(daemon_request));
+        if (request.magic != DAEMON_MAGIC || request.path_length > 64 * 1024) return false;
+        if (client->in_count - used < (int)(sizeof(daemon_request) + request.path_length)) break;
+        daemon_serve(daemon, client, &request, client->in + used + sizeof(daemon_request));
+        used += sizeof(daemon_request) + request.path_length;
+    }
+    memmove(client->in, client->in + used, client->in_count - used);
+    client->in_count -= used;
+    return true;
+}
+
+// NOTE: false once the client is gone
+bool daemon_client_write(daemon_client *client) {
+    while (client->out_sent < client->out.count) {
+        ssize_t n = send(client->fd, client->out.data + client->out_sent, client->out.count - client->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return true;
+            return false;
+        }
+        client->out_sent += (int)n;
+    }
+    client->out.count = client->out_sent = 0;
+    return true;
+}
+
+void daemon_client_close(daemon_client *client) {
+    close(client->fd);
+    free(client->in);
+    free(client->out.data);
+}
+
+bool run_daemon() {
+    struct sockaddr_un address;
+    if (!daemon_socket_path(&address)) {
+        return false;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        return false;
+    }
+    if (connect(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "Lister: a daemon is already listening on '%s'\n", address.sun_path);
+        close(listen_fd);
+        return false;
+    }
+    unlink(address.sun_path);
+    mode_t mask = umask(0077);
+    bool bound = bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0 && listen(listen_fd, 128) == 0;
+    umask(mask);
+    if (!bound) {
+        close(listen_fd);
+        return false;
+    }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    daemon_state daemon = {0};
+    daemon.notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    struct sigaction action = {0};
+    action.sa_handler = watch_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    daemon_client *clients = NULL;
+    int client_count = 0;
+    struct pollfd *poll_fds = NULL;
+    while (!watch_stop) {
+        poll_fds = realloc(poll_fds, (client_count + 2) * sizeof(struct pollfd));
+        poll_fds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+        poll_fds[1] = (struct pollfd){daemon.notify_fd, POLLIN, 0};
+        for (int i = 0; i < client_count; i++) {
+            short events = (clients[i].out_sent < clients[i].out.count) ? POLLOUT : POLLIN;
+            poll_fds[i + 2] = (struct pollfd){clients[i].fd, events, 0};
+        }
+        if (poll(poll_fds, client_count + 2, -1) <= 0) continue;
+
+        if (poll_fds[1].revents) {
+            daemon_drain_events(&daemon);
+        }
+        int polled = client_count;
+        for (int i = polled - 1; i >= 0; i--) {
+            daemon_client *client = &clients[i];
+            short revents = poll_fds[i + 2].revents;
+            bool alive = true;
+            if (revents & POLLIN) alive = daemon_client_read(&daemon, client);
+            if (alive && (revents & (POLLIN | POLLOUT))) alive = daemon_client_write(client);
+            if (!alive || (revents & (POLLERR | POLLNVAL)) || ((revents & POLLHUP) && !(revents & POLLIN))) {
+                daemon_client_close(client);
+                clients[i] = clients[--client_count];
+            }
+        }
+        if (poll_fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+                if (!daemon_peer_trusted(fd)) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                clients = realloc(clients, (client_count + 1) * sizeof(daemon_client));
+                memset(&clients[client_count], 0, sizeof(daemon_client));
+                clients[client_count].fd = fd;
+                clients[client_count].out.fd = -1;
+                client_count++;
+            }
+        }
+    }
+
+    for (int i = 0; i < client_count; i++) {
+        daemon_client_close(&clients[i]);
+    }
+    while (daemon.listing_count > 0) {
+        daemon_listing_free(&daemon, daemon.listing_count - 1);
+    }
+    free(clients);
+    free(poll_fds);
+    close(daemon.notify_fd);
+    close(listen_fd);
+    unlink(address.sun_path);
+    return true;
+}
+
+bool client_read(int fd, void *data, size_t size) {
+    char *ptr = (char *)data;
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+// NOTE: asks a running daemon for every path, the output is the same as listing them here.
+// Returns how many paths were handled, anything after that is left to the caller.
+int client_list(out_buffer *out, xp_path *paths, int count) {
+    struct sockaddr_un address;
+    if (!daemon_socket_path(&address)) {
+        return 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || !daemon_peer_trusted(fd)) {
+        close(fd);
+        return 0;
+    }
+
+    // NOTE: all requests go out at once so the daemon can work through them back to back
+    out_buffer requests = {0, 0, 0, -1};
+    for (int i = 0; i < count; i++) {
+        daemon_request request;
+        daemon_request_from_options(&request, paths[i]);
+        out_write(&requests, (char *)&request, sizeof(daemon_request));
+        out_write(&requests, (char *)paths[i].data, paths[i].count);
+    }
+    bool sent = true;
+    for (int written = 0; sent && written < requests.count;) {
+        ssize_t n = send(fd, requests.data + written, requests.count - written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        sent = n > 0;
+        written += sent ? (int)n : 0;
+    }
+    free(requests.data);
+
+    int served = 0;
+    bool first = true;
+    char buffer[OUTPUT_BUFFER_SIZE];
+    while (sent && served < count) {
+        daemon_reply reply;
+        if (!client_read(fd, &reply, sizeof(daemon_reply))) break;
+        if (!reply.listed) {
+            out_flush(out);
+            fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", paths[served].data);
+        } else {
+            if (!first) out_char(out, '\n');
+            first = false;
+            bool complete = true;
+            for (uint64_t left = reply.length; complete && left > 0;) {
+                size_t size = (size_t)MIN(left, sizeof(buffer));
+                complete = client_read(fd, buffer, size);
+                out_write(out, buffer, (int)size);
+                left -= size;
+            }
+            if (!complete) break;
+        }
+        served++;
+    }
+    close(fd);
+    return served;
+}
+#endif
+
+#ifdef DEVELOPER
+#include "bench.h"
+#endif
+
+int main(int argc, char **argv) {
+    argc--; argv++;
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO screen_buffer_info;
+    HANDLE hc = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD dw = 0;
+
+    // NOTE: colored output on windows
+    color_output = GetConsoleMode(hc, &dw);
+    dw |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+    SetConsoleMode(hc, dw);
+
+    GetConsoleScreenBufferInfo(hc, &screen_buffer_info);
     line_length = screen_buffer_info.srWindow.Right - screen_buffer_info.srWindow.Left + 1;
 #elif defined(__linux__)
     struct winsize w;
-    ioctl(0, TIOCGWINSZ, &w);
-    line_length = w.ws_col;
+    if (ioctl(0, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
+        line_length = w.ws_col;
+    }
+    color_output = isatty(STDOUT_FILENO);
 #endif
 
     process_args(argc, argv);
+#ifdef DEVELOPER
+    if (bench_dir) {
+        bool benched = run_bench(&output);
+        out_flush(&output);
+        return benched ? 0 : 1;
+    }
+#endif
 
     for (int i = 0; i < argc; i++) {
         char *arg = argv[i];
@@ -390,32 +3756,109 @@ int main(int argc, char **argv) {
         paths[path_count - 1] = current_path;
     }
 
-    if (path_count > 1) {
+    if (path_count > 1 || recursive) {
         print_dir_name = true;
     }
 
     for (int i = 0; i < path_count; i++) {
         xp_path arg = paths[i];
-        xp_path path = arg;
         if (xp_path_relative(arg)) {
-            path = xp_fullpath(arg);
-            paths[i] = path;
+            paths[i] = xp_fullpath(arg);
+        }
+    }
+
+    if (snapshot_file || diff_file) {
+        if (path_count > 1) {
+            fprintf(stderr, "Lister: %s takes a single path\n", diff_file ? "--diff" : "--snapshot");
+            return 1;
+        }
+        recursive = true;
+        bool done = diff_file ? run_diff(&output, paths[0]) : run_snapshot(paths[0]);
+        out_flush(&output);
+        return done ? 0 : 1;
+    }
+
+#ifdef __linux__
+    if (daemon_mode) {
+        if (!run_daemon()) {
+            fprintf(stderr, "Lister: failed to start the daemon\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // NOTE: the daemon only keeps plain listings, everything else is done here.
+    // Paths it could not answer, or all of them when none is running, are listed locally.
+    if (client_mode && !recursive && !disk_usage && !watch_mode && !matcher_active) {
+        int served = client_list(&output, paths, path_count);
+        paths += served;
+        path_count -= served;
+        if (path_count == 0) {
+            out_flush(&output);
+            return 0;
+        }
+    }
+
+    if (watch_mode && isatty(STDOUT_FILENO)) {
+        if (!watch_directory(&output, paths[0])) {
+            fprintf(stderr, "Lister: failed to watch '%s'\n", paths[0].data);
+        }
+        return 0;
+    }
+
+    // NOTE: -D totals depend on whole subtrees, a stamp on the listed directory says nothing about them
+    if (use_cache && !disk_usage) {
+        cache_init();
+    }
+#endif
+
+    // NOTE: -U keeps streaming one path at a time, buffering whole listings would defeat its constant memory
+    if (recursive || disk_usage || (path_count > 1 && !unsorted && !memory_budget)) {
+        walk_paths(&output, paths, path_count);
+        out_flush(&output);
+        return 0;
+    }
+
+    for (int i = 0; i < path_count; i++) {
+        xp_path path = paths[i];
+        if (unsorted) {
+            if (stream_directory(&output, path)) {
+                if (i < path_count - 1) {
+                    out_char(&output, '\n');
+                }
+            } else {
+                fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", path.data);
+            }
+            continue;
+        }
+
+        // NOTE: --limit already keeps only what it prints
+        if (memory_budget && limit_count == 0) {
+            if (spill_directory(&output, path)) {
+                if (i < path_count - 1) {
+                    out_char(&output, '\n');
+                }
+            } else {
+                out_flush(&output);
+                fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", path.data);
+            }
+            continue;
         }
 
         xp_directory dir = {0};
-        if (xp_directory_new(path, &dir)) {
-            filter_directory_files(&dir);
-            sort_directory_files(&dir, SORT_NAME);
-            sort_directory_files(&dir, sort_file_type);
-            print_directory(dir);
+        if (list_directory(path, &dir)) {
+            print_directory(&output, &dir);
+            xp_directory_free(&dir);
 
             if (i < path_count - 1) {
-                putchar('\n');
+                out_char(&output, '\n');
             }
         } else {
+            out_flush(&output);
             fprintf(stderr, "Lister: failed to access '%s': No such file or directory\n", dir.path.data);
         }
     }
 
+    out_flush(&output);
     return 0;
 }
@@ -1,404 +1,1800 @@
-#ifndef XPATH_H
-#define XPATH_H
-
-#ifdef _WIN32
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <shlwapi.h>
-#endif
-
-#ifdef __linux__
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <dirent.h>
-#include <time.h>
-#endif
-
-#include <stdint.h>
-#include <assert.h>
-#include <stdio.h>
-#include <stdbool.h>
-#include <string.h>
-
-#define XP_NORMAL          0x1
-#define XP_DIRECTORY       0x2
-#define XP_HIDDEN          0x4
-#define XP_READONLY        0x8
-#define XP_SYSTEM          0x10
-#define XP_EXECUTABLE      0x20
-
-typedef struct {
-    unsigned char *data;
-    int count;
-} xp_path;
-
-typedef struct {
-    uint32_t year;
-    uint32_t month;
-    uint32_t day;
-    uint32_t hour;
-    uint32_t minute;
-    uint32_t second;
-    uint32_t milliseconds;
-} xp_time;
-
-typedef struct {
-    char *name;
-    uint64_t bytes;
-    uint32_t attributes;
-    uint64_t time;
-} xp_file;
-
-typedef struct {
-    xp_path path;
-    xp_file *files;
-    int file_count;
-    // int file_cap;
-} xp_directory;
-
-#ifdef _WIN32
-bool xp_path_relative(xp_path path) {
-    assert(path.count > 0);
-    assert(path.data);
-
-    if (path.data[0] == '~') {
-        return false; 
-    }
-    return PathIsRelativeA((LPSTR)path.data);
-}
-#elif defined(__linux__)
-bool xp_path_relative(xp_path path) {
-    assert(path.count > 0);
-    assert(path.data);
-
-    if (path.data[0] == '~' || path.data[0] == '/') {
-        return false;
-    }
-    return true;
-}
-#endif
-
-
-void xp_append(xp_path *path, char *str) {
-    assert(path->data);
-    int len = path->count + (int)strlen(str);
-    char last = path->data[path->count - 1];
-    if (last != '\\' && last != '/') {
-        len++;
-    }
-    char *ptr = (char *)malloc(len + 1);
-    strncpy(ptr, (char *)path->data, path->count);
-    if (last != '\\' && last != '/') {
-        strcat(ptr, "/");
-    }
-    ptr[path->count] = '\0';
-    strcat(ptr, str);
-
-    free(path->data);
-    path->data = (unsigned char *)ptr;
-    path->count = len;
-}
-
-void xp_path_free(xp_path *path) {
-    if (path->data) free(path->data);
-    path->data = NULL;
-    path->count = 0;
-}
-
-inline void xp_directory_free(xp_directory *directory) {
-    xp_path_free(&directory->path);
-    if (directory->files) {
-        free(directory->files);
-    }
-    memset(&directory->path, 0, sizeof(xp_path));
-    directory->files = NULL;
-    directory->file_count = 0;
-}
-
-xp_path xp_path_new(char *file_name) {
-    xp_path path;
-    int len = (int)strlen(file_name);
-    path.data = (unsigned char *)malloc(len + 1);
-    strcpy((char *)path.data, file_name);
-    path.count = len;
-    return path;
-}
-
-xp_path xp_path_copy(xp_path path) {
-    xp_path copy;
-    copy.data = (unsigned char *)malloc(path.count + 1);
-    strncpy((char *)copy.data, (char *)path.data, path.count + 1);
-    copy.count = path.count;
-    return copy;
-}
-
-#ifdef _WIN32
-xp_path xp_get_home_path() {
-    char buffer[MAX_PATH];
-    GetEnvironmentVariableA("USERPROFILE", buffer, MAX_PATH);
-    strcat(buffer, "/");
-    xp_path home = xp_path_new(buffer);
-    return home;
-}
-#elif defined(__linux__)
-xp_path xp_get_home_path() {
-    char *home_path = NULL;
-    if ((home_path = getenv("HOME")) == NULL) {
-        // home_path = getpwuid(getuid())->pw_dir;
-    }
-    xp_path home = {home_path, strlen(home_path)};
-    return home;
-}
-#endif
-
-void xp_file_push(xp_directory *directory, xp_file file) {
-    assert(directory);
-    directory->files = (xp_file *)realloc(directory->files, sizeof(xp_file) * (directory->file_count + 1));
-    directory->files[directory->file_count++] = file;
-}
-
-void xp_replace_slashes(xp_path path) {
-    for (int i = 0; i < path.count; i++) {
-        if (path.data[i] == '\\')
-            path.data[i] = '/';
-    }
-}
-
-xp_path xp_parent_path(xp_path path) {
-    char *ptr = strrchr((char *)path.data, '/');
-    assert(ptr != NULL);
-    size_t len = ptr - (char *)path.data;
-
-    xp_path parent = {0};
-    parent.data = (unsigned char *)malloc(len + 2);
-    strncpy((char *)parent.data, (char *)path.data, len);
-    parent.data[len] = '/';
-    parent.data[len + 1] = '\0';
-    parent.count = (int)len + 1;
-    return parent;
-}
-
-#ifdef _WIN32
-xp_path xp_current_path() {
-    DWORD length = GetCurrentDirectory(0, NULL);
-    char *str = (char *)malloc(length + 1);
-    DWORD ret = GetCurrentDirectory(length, str);
-    str[ret] = '/';
-    str[ret + 1] = '\0';
-    xp_path path = {(unsigned char *)str, (int)ret};
-    xp_replace_slashes(path);
-    return path;
-}
-#elif defined(__linux__)
-xp_path xp_current_path() {
-    char *str = getcwd(NULL, 0);
-    xp_path path = {str, strlen(str)};
-    return path;
-}
-#endif
-
-
-xp_path xp_substr(xp_path path, int start, int count) {
-    if (count > path.count - start) count = path.count - start;
-    xp_path sub_path;
-    sub_path.data = (unsigned char *)malloc(count + 1);
-    sub_path.count = count;
-    strncpy((char *)sub_path.data, (char *)path.data + start, count);
-    sub_path.data[count] = '\0';
-    return sub_path;
-}
-
-void xp_normalize(xp_path *path) {
-    assert(path);
-    assert(path->count > 0);
-    // NOTE: replace '~' home directory
-    // Consider only replacing it for internal uses when calling different OS APIs
-    // but keeping the squiggle for everything else
-    if (path->data[0] == '~') {
-        xp_path new_path = xp_get_home_path();
-        xp_path rest = xp_substr(*path, 1, path->count - 1);
-        xp_append(&new_path, (char *)rest.data);
-        xp_path_free(path);
-        xp_path_free(&rest);
-        *path = new_path;
-    }
-    xp_replace_slashes(*path);
-}
-
-#if defined(_WIN32)
-xp_path xp_fullpath(xp_path path) {
-    assert(path.count > 0);
-    DWORD n = GetFullPathNameA((char *)path.data, 0, NULL, NULL);
-    xp_path full_path;
-    full_path.data = (unsigned char *)malloc(n);
-    n = GetFullPathNameA((char *)path.data, n, (char *)full_path.data, NULL);
-    full_path.count = (int)strlen((char *)full_path.data);
-    xp_replace_slashes(full_path);
-    return full_path;
-}
-#elif defined(__linux__)
-xp_path xp_fullpath(xp_path path) {
-    assert(path.count > 0);
-    xp_path full_path = path;
-    char *ptr = realpath(path.data, NULL);
-    if (ptr) {
-        full_path.data = ptr;
-        full_path.count = strlen(ptr);
-    } else {
-        // TODO: realpath error
-    }
-    return full_path;
-}
-#endif
-
-#if defined(_WIN32)
-bool xp_directory_new(xp_path path, xp_directory *directory) {
-    xp_normalize(&path);
-    memset(directory, 0, sizeof(xp_directory));
-    directory->path = xp_fullpath(path);
-    
-    char *find_path = (char *)malloc(path.count + strlen("/*") + 1);
-    memset(find_path, 0, path.count + strlen("/*") + 1);
-    strncpy(find_path, (char *)path.data, path.count);
-    strcat(find_path, "/*");
-
-    WIN32_FIND_DATAA find_data = {0};
-    HANDLE find_handle = FindFirstFileA(find_path, &find_data);
-    free(find_path);
-    if (find_handle == INVALID_HANDLE_VALUE) {
-        DWORD err = GetLastError();
-        // fprintf(stderr, "FindFirstFile failed (%d)\n", err);
-        return false;
-    }
-
-    do {
-        xp_file file = {0};
-
-        uint64_t bytes = (find_data.nFileSizeHigh * (MAXDWORD+1)) + find_data.nFileSizeLow;
-        char *file_name = (char *)malloc(strlen(find_data.cFileName) + 1);
-        strcpy(file_name, find_data.cFileName);
-        DWORD file_attributes = find_data.dwFileAttributes;
-        uint32_t attributes = 0;
-        
-        file.time = ((uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32) | (find_data.ftLastWriteTime.dwLowDateTime);
-
-        DWORD dw;
-        if (GetBinaryTypeA(find_data.cFileName, &dw)) {
-            attributes |= XP_EXECUTABLE;
-        }
-
-        if (file_attributes & FILE_ATTRIBUTE_DIRECTORY) {
-            attributes |= XP_DIRECTORY;
-        }
-        if (file_attributes & FILE_ATTRIBUTE_READONLY) {
-            attributes |= XP_READONLY;
-        }
-        if (file_attributes & FILE_ATTRIBUTE_NORMAL) {
-            attributes |= XP_NORMAL;
-        }
-
-        file.name = file_name;
-        file.bytes = bytes;
-        file.attributes = attributes;
-        xp_file_push(directory, file);
-    } while (FindNextFileA(find_handle, &find_data));
-
-    FindClose(find_handle);
-
-    return true;
-}
-#elif defined(__linux__)
-bool xp_directory_new(xp_path path, xp_directory *directory) {
-    xp_normalize(&path);
-    memset(directory, 0, sizeof(xp_directory));
-    directory->path = xp_fullpath(path);
-
-    DIR *d = opendir(path.data);
-    if (d == NULL) {
-        return false;
-    }
-
-    int dir_fd = dirfd(d);
-    if (dir_fd == -1) {
-        return false;
-    }
-    
-    if (d) {
-        for (;;) {
-            struct dirent *dir = readdir(d);
-            if (!dir) break;
-
-            struct stat f_stat;
-            int stat_res = fstatat(dir_fd, dir->d_name, &f_stat, 0);
-
-            xp_file file = {0};
-            file.name = malloc(strlen(dir->d_name) + 1);
-            strcpy(file.name, dir->d_name);
-            file.bytes = (uint64_t)f_stat.st_size;
-            file.time = f_stat.st_mtime; 
-
-            file.attributes |= (S_ISDIR(f_stat.st_mode) ? XP_DIRECTORY : 0);
-            file.attributes |= (S_ISREG(f_stat.st_mode) ? XP_NORMAL : 0);
-            file.attributes |= ((f_stat.st_mode & S_IXUSR) ? XP_EXECUTABLE : 0);
-
-            xp_file_push(directory, file);
-        }
-        closedir(d);
-    }
-    return true;
-}
-#endif
-
-void xp_path_append(xp_path *path, char *str) {
-    char *ptr = (char *)malloc(path->count + 1 + strlen(str) + 1);
-    strncpy(ptr, (char *)path->data, path->count);
-    strcat(ptr, "/");
-    strcat(ptr, str);
-
-    free(path->data);
-    path->data = (unsigned char *)ptr;
-    path->count = (int)strlen(ptr);
-}
-
-#if defined(_WIN32)
-xp_time xp_utc_time(uint64_t time) {
-    xp_time utc_time = {0};
-    FILETIME ft = {.dwLowDateTime = (uint32_t)time,
-        .dwHighDateTime = (uint32_t)(time >> 32)
-    };
-    FILETIME local_ft = {0};
-    SYSTEMTIME systime = {0};
-    if (FileTimeToLocalFileTime(&ft, &local_ft)) {
-        if (FileTimeToSystemTime(&local_ft, &systime)) {
-            utc_time.year = systime.wYear;
-            utc_time.month = systime.wMonth;
-            utc_time.day = systime.wDay;
-            utc_time.hour = systime.wHour;
-            utc_time.minute = systime.wMinute;
-            utc_time.second = systime.wSecond;
-            utc_time.milliseconds = systime.wMilliseconds;
-        } else {
-            // fprintf(stderr, "FileTimeToSystemTime error\n");
-        }
-    } else {
-        // fprintf(stderr, "FileTimeToLocalFileTime error\n");
-    }
-    return utc_time;
-}
-#elif defined(__linux__)
-xp_time xp_utc_time(uint64_t time) {
-    time_t time_ = (time_t)time;
-    struct tm *local_time = localtime(&time_);
-    xp_time utc_time = { 0 };
-    utc_time.year = local_time->tm_year;
-    utc_time.month = local_time->tm_mon + 1;
-    utc_time.day = local_time->tm_mday;
-    utc_time.hour = local_time->tm_hour;
-    utc_time.minute = local_time->tm_min;
-    utc_time.second = local_time->tm_sec;
-    return utc_time;
-}
-#endif
-
-#endif // XPATH_H
+#ifndef XPATH_H
+#define XPATH_H
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <shlwapi.h>
+#endif
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XP_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <stdint.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "xthread.h"
+
+#define XP_NORMAL          0x1
+#define XP_DIRECTORY       0x2
+#define XP_HIDDEN          0x4
+#define XP_READONLY        0x8
+#define XP_SYSTEM          0x10
+#define XP_EXECUTABLE      0x20
+#define XP_LINK            0x40
+// NOTE: a non-directory with more than one hard link, only known with XP_FIELD_USAGE
+#define XP_HARDLINKED      0x80
+
+// NOTE: metadata requested from xp_directory_scan, anything not asked for is left zeroed
+#define XP_FIELD_ATTRIBUTES 0x1
+#define XP_FIELD_SIZE       0x2
+#define XP_FIELD_TIME       0x4
+// NOTE: just the directory bit, cheaper than XP_FIELD_ATTRIBUTES where the listing already knows it
+#define XP_FIELD_TYPE       0x8
+// NOTE: sizes become allocated bytes of the entry itself (links are not followed),
+// and the inode and device columns are filled in
+#define XP_FIELD_USAGE      0x10
+#define XP_FIELD_ALL        (XP_FIELD_ATTRIBUTES | XP_FIELD_SIZE | XP_FIELD_TIME)
+// NOTE: drop dot files before they are copied or stat'd
+#define XP_SKIP_HIDDEN      0x100
+
+// NOTE: display properties of a name, worked out once at scan time
+#define XP_NAME_QUOTED      0x1
+// NOTE: has control characters, they are printed as '?'
+#define XP_NAME_ESCAPED     0x2
+
+#ifndef XP_DIRENT_BUFFER_SIZE
+#define XP_DIRENT_BUFFER_SIZE (256 * 1024)
+#endif
+// NOTE: initial size of a directory's name arena, it doubles whenever it fills up
+#ifndef XP_ARENA_BLOCK_SIZE
+#define XP_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+// NOTE: directories with fewer entries to stat than this are stat'd serially
+#ifndef XP_STAT_BATCH_MIN
+#define XP_STAT_BATCH_MIN 64
+#endif
+#ifndef XP_STAT_URING_DEPTH
+#define XP_STAT_URING_DEPTH 256
+#endif
+#ifndef XP_STAT_THREADS
+#define XP_STAT_THREADS 16
+#endif
+
+// NOTE: instrumentation hooks, they compile to nothing unless defined before xpath.h is included.
+// XP_COUNT adds n to a named counter, XP_PHASE_BEGIN/END add the time between them to a named phase.
+#ifndef XP_COUNT
+#define XP_COUNT(counter, n) ((void)(n))
+#endif
+#ifndef XP_PHASE_BEGIN
+#define XP_PHASE_BEGIN(phase) ((void)0)
+#define XP_PHASE_END(phase) ((void)0)
+#endif
+
+typedef struct {
+    unsigned char *data;
+    int count;
+} xp_path;
+
+typedef struct {
+    uint32_t year;
+    uint32_t month;
+    uint32_t day;
+    uint32_t hour;
+    uint32_t minute;
+    uint32_t second;
+    uint32_t milliseconds;
+} xp_time;
+
+typedef struct {
+    char *name;
+    uint64_t bytes;
+    uint32_t attributes;
+    uint64_t time;
+    uint64_t inode;
+    uint64_t device;
+} xp_file;
+
+// NOTE: bump allocator handing out offsets, so it can grow in place and is released at once
+typedef struct {
+    char *data;
+    size_t used;
+    size_t size;
+} xp_arena;
+
+// NOTE: one column per field, every column is filled once at scan time
+typedef struct {
+    xp_path path;
+    uint32_t fields;
+    int file_count;
+    int file_cap;
+    uint32_t *name_offsets;
+    uint16_t *name_lengths;
+    uint16_t *ext_offsets; // 0 when the name has no extension
+    uint16_t *widths;
+    uint8_t *name_flags;
+    uint64_t *sizes;
+    uint64_t *times;
+    uint32_t *attributes;
+    // NOTE: only allocated for XP_FIELD_USAGE
+    uint64_t *inodes;
+    uint64_t *devices;
+    xp_arena names;
+
+    // NOTE: entries in listing order, filtering and sorting only ever touch this
+    uint32_t *order;
+    int order_count;
+
+    // NOTE: set when the columns point into a mapped listing cache instead of the heap
+    void *mapping;
+    size_t mapping_size;
+} xp_directory;
+
+#ifdef _WIN32
+uint64_t xp_now_ns() {
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+}
+#elif defined(__linux__)
+// NOTE: monotonic, for timing only
+uint64_t xp_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+#endif
+
+#ifdef _WIN32
+bool xp_path_relative(xp_path path) {
+    assert(path.count > 0);
+    assert(path.data);
+
+    if (path.data[0] == '~') {
+        return false; 
+    }
+    return PathIsRelativeA((LPSTR)path.data);
+}
+#elif defined(__linux__)
+bool xp_path_relative(xp_path path) {
+    assert(path.count > 0);
+    assert(path.data);
+
+    if (path.data[0] == '~' || path.data[0] == '/') {
+        return false;
+    }
+    return true;
+}
+#endif
+
+
+void xp_append(xp_path *path, char *str) {
+    assert(path->data);
+    int len = path->count + (int)strlen(str);
+    char last = path->data[path->count - 1];
+    if (last != '\\' && last != '/') {
+        len++;
+    }
+    char *ptr = (char *)malloc(len + 1);
+    strncpy(ptr, (char *)path->data, path->count);
+    ptr[path->count] = '\0';
+    if (last != '\\' && last != '/') {
+        strcat(ptr, "/");
+    }
+    strcat(ptr, str);
+
+    free(path->data);
+    path->data = (unsigned char *)ptr;
+    path->count = len;
+}
+
+void xp_path_free(xp_path *path) {
+    if (path->data) free(path->data);
+    path->data = NULL;
+    path->count = 0;
+}
+
+uint32_t xp_arena_push(xp_arena *arena, size_t size) {
+    if (arena->used + size > arena->size) {
+        size_t arena_size = arena->size ? arena->size : XP_ARENA_BLOCK_SIZE;
+        while (arena_size < arena->used + size) arena_size *= 2;
+        arena->data = (char *)realloc(arena->data, arena_size);
+        arena->size = arena_size;
+        XP_COUNT(allocations, 1);
+    }
+    uint32_t offset = (uint32_t)arena->used;
+    arena->used += size;
+    return offset;
+}
+
+void xp_arena_release(xp_arena *arena) {
+    free(arena->data);
+    memset(arena, 0, sizeof(xp_arena));
+}
+
+void xp_directory_free(xp_directory *directory) {
+    xp_path_free(&directory->path);
+#ifdef __linux__
+    if (directory->mapping) {
+        munmap(directory->mapping, directory->mapping_size);
+        memset(directory, 0, sizeof(xp_directory));
+        return;
+    }
+#endif
+    xp_arena_release(&directory->names);
+    free(directory->name_offsets);
+    free(directory->name_lengths);
+    free(directory->ext_offsets);
+    free(directory->widths);
+    free(directory->name_flags);
+    free(directory->sizes);
+    free(directory->times);
+    free(directory->attributes);
+    free(directory->inodes);
+    free(directory->devices);
+    free(directory->order);
+    memset(directory, 0, sizeof(xp_directory));
+}
+
+xp_path xp_path_new(char *file_name) {
+    xp_path path;
+    int len = (int)strlen(file_name);
+    path.data = (unsigned char *)malloc(len + 1);
+    strcpy((char *)path.data, file_name);
+    path.count = len;
+    return path;
+}
+
+xp_path xp_path_copy(xp_path path) {
+    xp_path copy;
+    copy.data = (unsigned char *)malloc(path.count + 1);
+    strncpy((char *)copy.data, (char *)path.data, path.count + 1);
+    copy.count = path.count;
+    return copy;
+}
+
+#ifdef _WIN32
+xp_path xp_get_home_path() {
+    char buffer[MAX_PATH];
+    GetEnvironmentVariableA("USERPROFILE", buffer, MAX_PATH);
+    strcat(buffer, "/");
+    xp_path home = xp_path_new(buffer);
+    return home;
+}
+#elif defined(__linux__)
+xp_path xp_get_home_path() {
+    char *home_path = NULL;
+    if ((home_path = getenv("HOME")) == NULL) {
+        // home_path = getpwuid(getuid())->pw_dir;
+    }
+    xp_path home = {home_path, strlen(home_path)};
+    return home;
+}
+#endif
+
+static inline char *xp_file_name(const xp_directory *directory, uint32_t index) {
+    return directory->names.data + directory->name_offsets[index];
+}
+
+// NOTE: row view of one entry, the name points into the directory's arena
+xp_file xp_directory_file(const xp_directory *directory, uint32_t index) {
+    xp_file file;
+    file.name = xp_file_name(directory, index);
+    file.bytes = directory->sizes[index];
+    file.attributes = directory->attributes[index];
+    file.time = directory->times[index];
+    file.inode = directory->inodes ? directory->inodes[index] : 0;
+    file.device = directory->devices ? directory->devices[index] : 0;
+    return file;
+}
+
+// NOTE: code point ranges that are not one column wide, sorted, from Unicode 14. Zero for combining marks,
+// format characters and Hangul medial and final jamo, two for East Asian wide and fullwidth and most emoji.
+// Unassigned code points are folded into the ranges around them.
+static const uint32_t xp_width_ranges[][3] = {
+    {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0}, {0x05bf, 0x05bf, 0}, {0x05c1, 0x05c2, 0},
+    {0x05c4, 0x05c5, 0}, {0x05c7, 0x05c7, 0}, {0x0600, 0x0605, 0}, {0x0610, 0x061a, 0}, {0x061c, 0x061c, 0},
+    {0x064b, 0x065f, 0}, {0x0670, 0x0670, 0}, {0x06d6, 0x06dd, 0}, {0x06df, 0x06e4, 0}, {0x06e7, 0x06e8, 0},
+    {0x06ea, 0x06ed, 0}, {0x070f, 0x070f, 0}, {0x0711, 0x0711, 0}, {0x0730, 0x074a, 0}, {0x07a6, 0x07b0, 0},
+    {0x07eb, 0x07f3, 0}, {0x07fd, 0x07fd, 0}, {0x0816, 0x0819, 0}, {0x081b, 0x0823, 0}, {0x0825, 0x0827, 0},
+    {0x0829, 0x082d, 0}, {0x0859, 0x085b, 0}, {0x0890, 0x089f, 0}, {0x08ca, 0x0902, 0}, {0x093a, 0x093a, 0},
+    {0x093c, 0x093c, 0}, {0x0941, 0x0948, 0}, {0x094d, 0x094d, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0},
+    {0x0981, 0x0981, 0}, {0x09bc, 0x09bc, 0}, {0x09c1, 0x09c4, 0}, {0x09cd, 0x09cd, 0}, {0x09e2, 0x09e3, 0},
+    {0x09fe, 0x0a02, 0}, {0x0a3c, 0x0a3c, 0}, {0x0a41, 0x0a51, 0}, {0x0a70, 0x0a71, 0}, {0x0a75, 0x0a75, 0},
+    {0x0a81, 0x0a82, 0}, {0x0abc, 0x0abc, 0}, {0x0ac1, 0x0ac8, 0}, {0x0acd, 0x0acd, 0}, {0x0ae2, 0x0ae3, 0},
+    {0x0afa, 0x0b01, 0}, {0x0b3c, 0x0b3c, 0}, {0x0b3f, 0x0b3f, 0}, {0x0b41, 0x0b44, 0}, {0x0b4d, 0x0b56, 0},
+    {0x0b62, 0x0b63, 0}, {0x0b82, 0x0b82, 0}, {0x0bc0, 0x0bc0, 0}, {0x0bcd, 0x0bcd, 0}, {0x0c00, 0x0c00, 0},
+    {0x0c04, 0x0c04, 0}, {0x0c3c, 0x0c3c, 0}, {0x0c3e, 0x0c40, 0}, {0x0c46, 0x0c56, 0}, {0x0c62, 0x0c63, 0},
+    {0x0c81, 0x0c81, 0}, {0x0cbc, 0x0cbc, 0}, {0x0cbf, 0x0cbf, 0}, {0x0cc6, 0x0cc6, 0}, {0x0ccc, 0x0ccd, 0},
+    {0x0ce2, 0x0ce3, 0}, {0x0d00, 0x0d01, 0}, {0x0d3b, 0x0d3c, 0}, {0x0d41, 0x0d44, 0}, {0x0d4d, 0x0d4d, 0},
+    {0x0d62, 0x0d63, 0}, {0x0d81, 0x0d81, 0}, {0x0dca, 0x0dca, 0}, {0x0dd2, 0x0dd6, 0}, {0x0e31, 0x0e31, 0},
+    {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0}, {0x0eb1, 0x0eb1, 0}, {0x0eb4, 0x0ebc, 0}, {0x0ec8, 0x0ecd, 0},
+    {0x0f18, 0x0f19, 0}, {0x0f35, 0x0f35, 0}, {0x0f37, 0x0f37, 0}, {0x0f39, 0x0f39, 0}, {0x0f71, 0x0f7e, 0},
+    {0x0f80, 0x0f84, 0}, {0x0f86, 0x0f87, 0}, {0x0f8d, 0x0fbc, 0}, {0x0fc6, 0x0fc6, 0}, {0x102d, 0x1030, 0},
+    {0x1032, 0x1037, 0}, {0x1039, 0x103a, 0}, {0x103d, 0x103e, 0}, {0x1058, 0x1059, 0}, {0x105e, 0x1060, 0},
+    {0x1071, 0x1074, 0}, {0x1082, 0x1082, 0}, {0x1085, 0x1086, 0}, {0x108d, 0x108d, 0}, {0x109d, 0x109d, 0},
+    {0x1100, 0x115f, 2}, {0x1160, 0x11ff, 0}, {0x135d, 0x135f, 0}, {0x1712, 0x1714, 0}, {0x1732, 0x1733, 0},
+    {0x1752, 0x1753, 0}, {0x1772, 0x1773, 0}, {0x17b4, 0x17b5, 0}, {0x17b7, 0x17bd, 0}, {0x17c6, 0x17c6, 0},
+    {0x17c9, 0x17d3, 0}, {0x17dd, 0x17dd, 0}, {0x180b, 0x180f, 0}, {0x1885, 0x1886, 0}, {0x18a9, 0x18a9, 0},
+    {0x1920, 0x1922, 0}, {0x1927, 0x1928, 0}, {0x1932, 0x1932, 0}, {0x1939, 0x193b, 0}, {0x1a17, 0x1a18, 0},
+    {0x1a1b, 0x1a1b, 0}, {0x1a56, 0x1a56, 0}, {0x1a58, 0x1a60, 0}, {0x1a62, 0x1a62, 0}, {0x1a65, 0x1a6c, 0},
+    {0x1a73, 0x1a7f, 0}, {0x1ab0, 0x1b03, 0}, {0x1b34, 0x1b34, 0}, {0x1b36, 0x1b3a, 0}, {0x1b3c, 0x1b3c, 0},
+    {0x1b42, 0x1b42, 0}, {0x1b6b, 0x1b73, 0}, {0x1b80, 0x1b81, 0}, {0x1ba2, 0x1ba5, 0}, {0x1ba8, 0x1ba9, 0},
+    {0x1bab, 0x1bad, 0}, {0x1be6, 0x1be6, 0}, {0x1be8, 0x1be9, 0}, {0x1bed, 0x1bed, 0}, {0x1bef, 0x1bf1, 0},
+    {0x1c2c, 0x1c33, 0}, {0x1c36, 0x1c37, 0}, {0x1cd0, 0x1cd2, 0}, {0x1cd4, 0x1ce0, 0}, {0x1ce2, 0x1ce8, 0},
+    {0x1ced, 0x1ced, 0}, {0x1cf4, 0x1cf4, 0}, {0x1cf8, 0x1cf9, 0}, {0x1dc0, 0x1dff, 0}, {0x200b, 0x200f, 0},
+    {0x202a, 0x202e, 0}, {0x2060, 0x206f, 0}, {0x20d0, 0x20f0, 0}, {0x231a, 0x231b, 2}, {0x2329, 0x232a, 2},
+    {0x23e9, 0x23ec, 2}, {0x23f0, 0x23f0, 2}, {0x23f3, 0x23f3, 2}, {0x25fd, 0x25fe, 2}, {0x2614, 0x2615, 2},
+    {0x2648, 0x2653, 2}, {0x267f, 0x267f, 2}, {0x2693, 0x2693, 2}, {0x26a1, 0x26a1, 2}, {0x26aa, 0x26ab, 2},
+    {0x26bd, 0x26be, 2}, {0x26c4, 0x26c5, 2}, {0x26ce, 0x26ce, 2}, {0x26d4, 0x26d4, 2}, {0x26ea, 0x26ea, 2},
+    {0x26f2, 0x26f3, 2}, {0x26f5, 0x26f5, 2}, {0x26fa, 0x26fa, 2}, {0x26fd, 0x26fd, 2}, {0x2705, 0x2705, 2},
+    {0x270a, 0x270b, 2}, {0x2728, 0x2728, 2}, {0x274c, 0x274c, 2}, {0x274e, 0x274e, 2}, {0x2753, 0x2755, 2},
+    {0x2757, 0x2757, 2}, {0x2795, 0x2797, 2}, {0x27b0, 0x27b0, 2}, {0x27bf, 0x27bf, 2}, {0x2b1b, 0x2b1c, 2},
+    {0x2b50, 0x2b50, 2}, {0x2b55, 0x2b55, 2}, {0x2cef, 0x2cf1, 0}, {0x2d7f, 0x2d7f, 0}, {0x2de0, 0x2dff, 0},
+    {0x2e80, 0x3029, 2}, {0x302a, 0x302d, 0}, {0x302e, 0x303e, 2}, {0x3041, 0x3096, 2}, {0x3099, 0x309a, 0},
+    {0x309b, 0x3247, 2}, {0x3250, 0x4dbf, 2}, {0x4e00, 0xa4c6, 2}, {0xa66f, 0xa672, 0}, {0xa674, 0xa67d, 0},
+    {0xa69e, 0xa69f, 0}, {0xa6f0, 0xa6f1, 0}, {0xa802, 0xa802, 0}, {0xa806, 0xa806, 0}, {0xa80b, 0xa80b, 0},
+    {0xa825, 0xa826, 0}, {0xa82c, 0xa82c, 0}, {0xa8c4, 0xa8c5, 0}, {0xa8e0, 0xa8f1, 0}, {0xa8ff, 0xa8ff, 0},
+    {0xa926, 0xa92d, 0}, {0xa947, 0xa951, 0}, {0xa960, 0xa97c, 2}, {0xa980, 0xa982, 0}, {0xa9b3, 0xa9b3, 0},
+    {0xa9b6, 0xa9b9, 0}, {0xa9bc, 0xa9bd, 0}, {0xa9e5, 0xa9e5, 0}, {0xaa29, 0xaa2e, 0}, {0xaa31, 0xaa32, 0},
+    {0xaa35, 0xaa36, 0}, {0xaa43, 0xaa43, 0}, {0xaa4c, 0xaa4c, 0}, {0xaa7c, 0xaa7c, 0}, {0xaab0, 0xaab0, 0},
+    {0xaab2, 0xaab4, 0}, {0xaab7, 0xaab8, 0}, {0xaabe, 0xaabf, 0}, {0xaac1, 0xaac1, 0}, {0xaaec, 0xaaed, 0},
+    {0xaaf6, 0xaaf6, 0}, {0xabe5, 0xabe5, 0}, {0xabe8, 0xabe8, 0}, {0xabed, 0xabed, 0}, {0xac00, 0xd7a3, 2},
+    {0xd7b0, 0xd7ff, 0}, {0xf900, 0xfaff, 2}, {0xfb1e, 0xfb1e, 0}, {0xfe00, 0xfe0f, 0}, {0xfe10, 0xfe19, 2},
+    {0xfe20, 0xfe2f, 0}, {0xfe30, 0xfe6b, 2}, {0xfeff, 0xfeff, 0}, {0xff01, 0xff60, 2}, {0xffe0, 0xffe6, 2},
+    {0xfff9, 0xfffb, 0}, {0x101fd, 0x101fd, 0}, {0x102e0, 0x102e0, 0}, {0x10376, 0x1037a, 0}, {0x10a01, 0x10a0f, 0},
+    {0x10a38, 0x10a3f, 0}, {0x10ae5, 0x10ae6, 0}, {0x10d24, 0x10d27, 0}, {0x10eab, 0x10eac, 0}, {0x10f46, 0x10f50, 0},
+    {0x10f82, 0x10f85, 0}, {0x11001, 0x11001, 0}, {0x11038, 0x11046, 0}, {0x11070, 0x11070, 0}, {0x11073, 0x11074, 0},
+    {0x1107f, 0x11081, 0}, {0x110b3, 0x110b6, 0}, {0x110b9, 0x110ba, 0}, {0x110bd, 0x110bd, 0}, {0x110c2, 0x110cd, 0},
+    {0x11100, 0x11102, 0}, {0x11127, 0x1112b, 0}, {0x1112d, 0x11134, 0}, {0x11173, 0x11173, 0}, {0x11180, 0x11181, 0},
+    {0x111b6, 0x111be, 0}, {0x111c9, 0x111cc, 0}, {0x111cf, 0x111cf, 0}, {0x1122f, 0x11231, 0}, {0x11234, 0x11234, 0},
+    {0x11236, 0x11237, 0}, {0x1123e, 0x1123e, 0}, {0x112df, 0x112df, 0}, {0x112e3, 0x112ea, 0}, {0x11300, 0x11301, 0},
+    {0x1133b, 0x1133c, 0}, {0x11340, 0x11340, 0}, {0x11366, 0x11374, 0}, {0x11438, 0x1143f, 0}, {0x11442, 0x11444, 0},
+    {0x11446, 0x11446, 0}, {0x1145e, 0x1145e, 0}, {0x114b3, 0x114b8, 0}, {0x114ba, 0x114ba, 0}, {0x114bf, 0x114c0, 0},
+    {0x114c2, 0x114c3, 0}, {0x115b2, 0x115b5, 0}, {0x115bc, 0x115bd, 0}, {0x115bf, 0x115c0, 0}, {0x115dc, 0x115dd, 0},
+    {0x11633, 0x1163a, 0}, {0x1163d, 0x1163d, 0}, {0x1163f, 0x11640, 0}, {0x116ab, 0x116ab, 0}, {0x116ad, 0x116ad, 0},
+    {0x116b0, 0x116b5, 0}, {0x116b7, 0x116b7, 0}, {0x1171d, 0x1171f, 0}, {0x11722, 0x11725, 0}, {0x11727, 0x1172b, 0},
+    {0x1182f, 0x11837, 0}, {0x11839, 0x1183a, 0}, {0x1193b, 0x1193c, 0}, {0x1193e, 0x1193e, 0}, {0x11943, 0x11943, 0},
+    {0x119d4, 0x119db, 0}, {0x119e0, 0x119e0, 0}, {0x11a01, 0x11a0a, 0}, {0x11a33, 0x11a38, 0}, {0x11a3b, 0x11a3e, 0},
+    {0x11a47, 0x11a47, 0}, {0x11a51, 0x11a56, 0}, {0x11a59, 0x11a5b, 0}, {0x11a8a, 0x11a96, 0}, {0x11a98, 0x11a99, 0},
+    {0x11c30, 0x11c3d, 0}, {0x11c3f, 0x11c3f, 0}, {0x11c92, 0x11ca7, 0}, {0x11caa, 0x11cb0, 0}, {0x11cb2, 0x11cb3, 0},
+    {0x11cb5, 0x11cb6, 0}, {0x11d31, 0x11d45, 0}, {0x11d47, 0x11d47, 0}, {0x11d90, 0x11d91, 0}, {0x11d95, 0x11d95, 0},
+    {0x11d97, 0x11d97, 0}, {0x11ef3, 0x11ef4, 0}, {0x13430, 0x13438, 0}, {0x16af0, 0x16af4, 0}, {0x16b30, 0x16b36, 0},
+    {0x16f4f, 0x16f4f, 0}, {0x16f8f, 0x16f92, 0}, {0x16fe0, 0x16fe3, 2}, {0x16fe4, 0x16fe4, 0}, {0x16ff0, 0x1b2fb, 2},
+    {0x1bc9d, 0x1bc9e, 0}, {0x1bca0, 0x1cf46, 0}, {0x1d167, 0x1d169, 0}, {0x1d173, 0x1d182, 0}, {0x1d185, 0x1d18b, 0},
+    {0x1d1aa, 0x1d1ad, 0}, {0x1d242, 0x1d244, 0}, {0x1da00, 0x1da36, 0}, {0x1da3b, 0x1da6c, 0}, {0x1da75, 0x1da75, 0},
+    {0x1da84, 0x1da84, 0}, {0x1da9b, 0x1daaf, 0}, {0x1e000, 0x1e02a, 0}, {0x1e130, 0x1e136, 0}, {0x1e2ae, 0x1e2ae, 0},
+    {0x1e2ec, 0x1e2ef, 0}, {0x1e8d0, 0x1e8d6, 0}, {0x1e944, 0x1e94a, 0}, {0x1f004, 0x1f004, 2}, {0x1f0cf, 0x1f0cf, 2},
+    {0x1f18e, 0x1f18e, 2}, {0x1f191, 0x1f19a, 2}, {0x1f200, 0x1f320, 2}, {0x1f32d, 0x1f335, 2}, {0x1f337, 0x1f37c, 2},
+    {0x1f37e, 0x1f393, 2}, {0x1f3a0, 0x1f3ca, 2}, {0x1f3cf, 0x1f3d3, 2}, {0x1f3e0, 0x1f3f0, 2}, {0x1f3f4, 0x1f3f4, 2},
+    {0x1f3f8, 0x1f43e, 2}, {0x1f440, 0x1f440, 2}, {0x1f442, 0x1f4fc, 2}, {0x1f4ff, 0x1f53d, 2}, {0x1f54b, 0x1f54e, 2},
+    {0x1f550, 0x1f567, 2}, {0x1f57a, 0x1f57a, 2}, {0x1f595, 0x1f596, 2}, {0x1f5a4, 0x1f5a4, 2}, {0x1f5fb, 0x1f64f, 2},
+    {0x1f680, 0x1f6c5, 2}, {0x1f6cc, 0x1f6cc, 2}, {0x1f6d0, 0x1f6d2, 2}, {0x1f6d5, 0x1f6df, 2}, {0x1f6eb, 0x1f6ec, 2},
+    {0x1f6f4, 0x1f6fc, 2}, {0x1f7e0, 0x1f7f0, 2}, {0x1f90c, 0x1f93a, 2}, {0x1f93c, 0x1f945, 2}, {0x1f947, 0x1f9ff, 2},
+    {0x1fa70, 0x1faf6, 2}, {0x20000, 0x3fffd, 2}, {0xe0001, 0xe01ef, 0}
+};
+
+// NOTE: columns a printable code point takes in a terminal
+int xp_codepoint_width(uint32_t c) {
+    // NOTE: CJK ideographs and Hangul syllables, the bulk of wide names
+    if ((c >= 0x4e00 && c <= 0x9fff) || (c >= 0xac00 && c <= 0xd7a3)) return 2;
+    int count = sizeof(xp_width_ranges) / sizeof(xp_width_ranges[0]);
+    if (c < xp_width_ranges[0][0] || c > xp_width_ranges[count - 1][1]) return 1;
+    int low = 0;
+    int high = count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (c > xp_width_ranges[mid][1]) low = mid + 1;
+        else if (c < xp_width_ranges[mid][0]) high = mid - 1;
+        else return (int)xp_width_ranges[mid][2];
+    }
+    return 1;
+}
+
+// NOTE: length in bytes of the UTF-8 sequence at text, 0 when it is not valid UTF-8
+int xp_utf8_decode(const unsigned char *text, int length, uint32_t *c) {
+    int count = 0;
+    uint32_t min = 0;
+    if (text[0] < 0x80) { *c = text[0]; return 1; }
+    else if ((text[0] & 0xe0) == 0xc0) { *c = text[0] & 0x1f; count = 2; min = 0x80; }
+    else if ((text[0] & 0xf0) == 0xe0) { *c = text[0] & 0x0f; count = 3; min = 0x800; }
+    else if ((text[0] & 0xf8) == 0xf0) { *c = text[0] & 0x07; count = 4; min = 0x10000; }
+    else return 0;
+    if (count > length) return 0;
+    for (int i = 1; i < count; i++) {
+        if ((text[i] & 0xc0) != 0x80) return 0;
+        *c = (*c << 6) | (text[i] & 0x3f);
+    }
+    if (*c < min || *c > 0x10ffff || (*c >= 0xd800 && *c <= 0xdfff)) return 0;
+    return count;
+}
+
+// NOTE: C0, DEL and C1 controls, they would be interpreted by the terminal
+bool xp_control(uint32_t c) {
+    return c < 0x20 || (c >= 0x7f && c < 0xa0);
+}
+
+// NOTE: every byte is printable ASCII other than space, nearly every name is, and those need no decoding.
+// Sixteen bytes at a time with SSE2, eight at a time in a register otherwise.
+bool xp_name_plain(const char *name, int length) {
+    int i = 0;
+#ifdef XP_SSE2
+    const __m128i below = _mm_set1_epi8(0x21);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(name + i));
+        // NOTE: signed compare, bytes with the top bit set are negative and land below '!' as well
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(bytes, below), _mm_cmpeq_epi8(bytes, del));
+        if (_mm_movemask_epi8(special)) return false;
+    }
+#endif
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t bytes;
+        memcpy(&bytes, name + i, sizeof(bytes));
+        // NOTE: top bits of bytes that are 0x80 or more, below 0x21 or equal to 0x7f
+        uint64_t not_del = bytes ^ (ones * 0x7f);
+        uint64_t special = bytes | ((bytes - ones * 0x21) & ~bytes) | ((not_del - ones) & ~not_del);
+        if (special & highs) return false;
+    }
+    for (; i < length; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (c <= ' ' || c >= 0x7f) return false;
+    }
+    return true;
+}
+
+// NOTE: printed width of a name, quotes included. Bytes that are not valid UTF-8 are counted
+// as one column each, control characters as the one column of their '?'.
+int xp_name_width(char *name, int length, uint8_t *flags) {
+    *flags = 0;
+    if (xp_name_plain(name, length)) {
+        return length;
+    }
+
+    const unsigned char *text = (const unsigned char *)name;
+    int width = 0;
+    for (int i = 0; i < length;) {
+        uint32_t c = text[i];
+        if (c > ' ' && c < 0x7f) {
+            width++;
+            i++;
+            continue;
+        }
+        int count = xp_utf8_decode(text + i, length - i, &c);
+        if (count == 0) {
+            width++;
+            i++;
+            continue;
+        }
+        if (c == ' ') *flags |= XP_NAME_QUOTED;
+        if (xp_control(c)) {
+            *flags |= XP_NAME_ESCAPED;
+            width++;
+        } else {
+            width += xp_codepoint_width(c);
+        }
+        i += count;
+    }
+    return (*flags & XP_NAME_QUOTED) ? width + 2 : width;
+}
+
+void xp_file_store(xp_directory *directory, uint32_t index, xp_file *file) {
+    directory->sizes[index] = file->bytes;
+    directory->times[index] = file->time;
+    directory->attributes[index] = file->attributes;
+    if (directory->inodes) {
+        directory->inodes[index] = file->inode;
+        directory->devices[index] = file->device;
+    }
+}
+
+// NOTE: fills in the name columns of an entry whose name is already at offset in the arena
+void xp_file_set_name(xp_directory *directory, uint32_t index, uint32_t offset) {
+    char *name = directory->names.data + offset;
+    int length = (int)strlen(name);
+    directory->name_offsets[index] = offset;
+    directory->name_lengths[index] = (uint16_t)length;
+
+    directory->ext_offsets[index] = 0;
+    for (int i = length - 1; i >= 0; i--) {
+        if (name[i] == '.') {
+            directory->ext_offsets[index] = (uint16_t)(i + 1);
+            break;
+        }
+    }
+    directory->widths[index] = (uint16_t)xp_name_width(name, length, &directory->name_flags[index]);
+}
+
+uint32_t xp_file_reserve(xp_directory *directory) {
+    assert(directory);
+    if (directory->file_count == directory->file_cap) {
+        int cap = directory->file_cap ? directory->file_cap * 2 : 256;
+        directory->name_offsets = (uint32_t *)realloc(directory->name_offsets, cap * sizeof(uint32_t));
+        directory->name_lengths = (uint16_t *)realloc(directory->name_lengths, cap * sizeof(uint16_t));
+        directory->ext_offsets = (uint16_t *)realloc(directory->ext_offsets, cap * sizeof(uint16_t));
+        directory->widths = (uint16_t *)realloc(directory->widths, cap * sizeof(uint16_t));
+        directory->name_flags = (uint8_t *)realloc(directory->name_flags, cap * sizeof(uint8_t));
+        directory->sizes = (uint64_t *)realloc(directory->sizes, cap * sizeof(uint64_t));
+        directory->times = (uint64_t *)realloc(directory->times, cap * sizeof(uint64_t));
+        directory->attributes = (uint32_t *)realloc(directory->attributes, cap * sizeof(uint32_t));
+        if (directory->fields & XP_FIELD_USAGE) {
+            directory->inodes = (uint64_t *)realloc(directory->inodes, cap * sizeof(uint64_t));
+            directory->devices = (uint64_t *)realloc(directory->devices, cap * sizeof(uint64_t));
+        }
+        directory->file_cap = cap;
+        XP_COUNT(allocations, 1);
+    }
+    return directory->file_count++;
+}
+
+uint32_t xp_file_push_at(xp_directory *directory, uint32_t offset, xp_file *file) {
+    uint32_t index = xp_file_reserve(directory);
+    xp_file_set_name(directory, index, offset);
+    xp_file_store(directory, index, file);
+    return index;
+}
+
+uint32_t xp_arena_push_string(xp_arena *arena, char *str) {
+    size_t length = strlen(str);
+    uint32_t offset = xp_arena_push(arena, length + 1);
+    memcpy(arena->data + offset, str, length + 1);
+    return offset;
+}
+
+uint32_t xp_file_push(xp_directory *directory, char *name, xp_file *file) {
+    return xp_file_push_at(directory, xp_arena_push_string(&directory->names, name), file);
+}
+
+// NOTE: copies an entry of another directory, precomputed columns included
+uint32_t xp_file_copy(xp_directory *directory, const xp_directory *source, uint32_t source_index) {
+    uint32_t index = xp_file_reserve(directory);
+    int length = source->name_lengths[source_index];
+    uint32_t offset = xp_arena_push(&directory->names, length + 1);
+    memcpy(directory->names.data + offset, xp_file_name(source, source_index), length + 1);
+    directory->name_offsets[index] = offset;
+    directory->name_lengths[index] = (uint16_t)length;
+    directory->ext_offsets[index] = source->ext_offsets[source_index];
+    directory->widths[index] = source->widths[source_index];
+    directory->name_flags[index] = source->name_flags[source_index];
+    directory->sizes[index] = source->sizes[source_index];
+    directory->times[index] = source->times[source_index];
+    directory->attributes[index] = source->attributes[source_index];
+    if (directory->inodes) {
+        directory->inodes[index] = source->inodes ? source->inodes[source_index] : 0;
+        directory->devices[index] = source->devices ? source->devices[source_index] : 0;
+    }
+    return index;
+}
+
+// NOTE: overwrites an entry in place, the old name is only reused when the new one fits.
+// Callers that replace a lot should compact the names now and then.
+void xp_file_replace(xp_directory *directory, uint32_t index, char *name, xp_file *file) {
+    size_t length = strlen(name);
+    uint32_t offset = directory->name_offsets[index];
+    if (length <= directory->name_lengths[index]) {
+        memcpy(directory->names.data + offset, name, length + 1);
+    } else {
+        offset = xp_arena_push_string(&directory->names, name);
+    }
+    xp_file_set_name(directory, index, offset);
+    xp_file_store(directory, index, file);
+}
+
+// NOTE: drops names no longer referenced by any entry
+void xp_directory_compact_names(xp_directory *directory) {
+    xp_arena names = {0};
+    for (int i = 0; i < directory->file_count; i++) {
+        directory->name_offsets[i] = xp_arena_push_string(&names, xp_file_name(directory, i));
+    }
+    xp_arena_release(&directory->names);
+    directory->names = names;
+}
+
+// NOTE: empties the directory but keeps its columns allocated for reuse
+void xp_directory_clear(xp_directory *directory) {
+    directory->file_count = 0;
+    directory->order_count = 0;
+    directory->names.used = 0;
+}
+
+// NOTE: called for every entry of xp_directory_visit, the scratch directory is reused after proc returns.
+// Returning false stops the visit.
+typedef bool (*xp_visit_proc)(xp_directory *chunk, uint32_t index, void *user);
+
+// NOTE: runs on the name before anything is copied or stat'd, attributes only hold what the
+// directory listing itself knows (XP_DIRECTORY, XP_NORMAL). Returning false skips the entry.
+typedef bool (*xp_filter_proc)(char *name, uint32_t attributes, void *user);
+
+// NOTE: every scanned entry in directory order
+void xp_directory_reset_order(xp_directory *directory) {
+    directory->order = (uint32_t *)realloc(directory->order, (directory->file_count ? directory->file_count : 1) * sizeof(uint32_t));
+    XP_COUNT(allocations, 1);
+    for (int i = 0; i < directory->file_count; i++) {
+        directory->order[i] = i;
+    }
+    directory->order_count = directory->file_count;
+}
+
+void xp_replace_slashes(xp_path path) {
+    for (int i = 0; i < path.count; i++) {
+        if (path.data[i] == '\\')
+            path.data[i] = '/';
+    }
+}
+
+xp_path xp_parent_path(xp_path path) {
+    char *ptr = strrchr((char *)path.data, '/');
+    assert(ptr != NULL);
+    size_t len = ptr - (char *)path.data;
+
+    xp_path parent = {0};
+    parent.data = (unsigned char *)malloc(len + 2);
+    strncpy((char *)parent.data, (char *)path.data, len);
+    parent.data[len] = '/';
+    parent.data[len + 1] = '\0';
+    parent.count = (int)len + 1;
+    return parent;
+}
+
+#ifdef _WIN32
+xp_path xp_current_path() {
+    DWORD length = GetCurrentDirectory(0, NULL);
+    char *str = (char *)malloc(length + 1);
+    DWORD ret = GetCurrentDirectory(length, str);
+    str[ret] = '/';
+    str[ret + 1] = '\0';
+    xp_path path = {(unsigned char *)str, (int)ret};
+    xp_replace_slashes(path);
+    return path;
+}
+#elif defined(__linux__)
+xp_path xp_current_path() {
+    char *str = getcwd(NULL, 0);
+    xp_path path = {str, strlen(str)};
+    return path;
+}
+#endif
+
+
+xp_path xp_substr(xp_path path, int start, int count) {
+    if (count > path.count - start) count = path.count - start;
+    xp_path sub_path;
+    sub_path.data = (unsigned char *)malloc(count + 1);
+    sub_path.count = count;
+    strncpy((char *)sub_path.data, (char *)path.data + start, count);
+    sub_path.data[count] = '\0';
+    return sub_path;
+}
+
+void xp_normalize(xp_path *path) {
+    assert(path);
+    assert(path->count > 0);
+    // NOTE: replace '~' home directory
+    // Consider only replacing it for internal uses when calling different OS APIs
+    // but keeping the squiggle for everything else
+    if (path->data[0] == '~') {
+        xp_path new_path = xp_get_home_path();
+        xp_path rest = xp_substr(*path, 1, path->count - 1);
+        xp_append(&new_path, (char *)rest.data);
+        xp_path_free(path);
+        xp_path_free(&rest);
+        *path = new_path;
+    }
+    xp_replace_slashes(*path);
+}
+
+#if defined(_WIN32)
+xp_path xp_fullpath(xp_path path) {
+    assert(path.count > 0);
+    XP_PHASE_BEGIN(fullpath);
+    DWORD n = GetFullPathNameA((char *)path.data, 0, NULL, NULL);
+    xp_path full_path;
+    full_path.data = (unsigned char *)malloc(n);
+    n = GetFullPathNameA((char *)path.data, n, (char *)full_path.data, NULL);
+    full_path.count = (int)strlen((char *)full_path.data);
+    xp_replace_slashes(full_path);
+    XP_PHASE_END(fullpath);
+    return full_path;
+}
+#elif defined(__linux__)
+xp_path xp_fullpath(xp_path path) {
+    assert(path.count > 0);
+    XP_PHASE_BEGIN(fullpath);
+    xp_path full_path = path;
+    char *ptr = realpath(path.data, NULL);
+    if (ptr) {
+        full_path.data = ptr;
+        full_path.count = strlen(ptr);
+    } else {
+        // TODO: realpath error
+    }
+    XP_PHASE_END(fullpath);
+    return full_path;
+}
+#endif
+
+#if defined(_WIN32)
+HANDLE xp_find_first(xp_path *path, WIN32_FIND_DATAA *find_data) {
+    xp_normalize(path);
+    char *find_path = (char *)malloc(path->count + strlen("/*") + 1);
+    memset(find_path, 0, path->count + strlen("/*") + 1);
+    strncpy(find_path, (char *)path->data, path->count);
+    strcat(find_path, "/*");
+
+    XP_PHASE_BEGIN(enumerate);
+    HANDLE find_handle = FindFirstFileA(find_path, find_data);
+    XP_PHASE_END(enumerate);
+    XP_COUNT(dir_opens, 1);
+    free(find_path);
+    if (find_handle == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        // fprintf(stderr, "FindFirstFile failed (%d)\n", err);
+    }
+    return find_handle;
+}
+
+void xp_find_data_file(WIN32_FIND_DATAA *find_data, uint32_t fields, xp_file *file) {
+    memset(file, 0, sizeof(xp_file));
+    uint64_t bytes = (find_data->nFileSizeHigh * (MAXDWORD+1)) + find_data->nFileSizeLow;
+    DWORD file_attributes = find_data->dwFileAttributes;
+    uint32_t attributes = 0;
+        
+    file->time = ((uint64_t)find_data->ftLastWriteTime.dwHighDateTime << 32) | (find_data->ftLastWriteTime.dwLowDateTime);
+
+    DWORD dw;
+    if (fields & XP_FIELD_ATTRIBUTES) {
+        XP_COUNT(stat_calls, 1);
+        if (GetBinaryTypeA(find_data->cFileName, &dw)) attributes |= XP_EXECUTABLE;
+    }
+
+    if (file_attributes & FILE_ATTRIBUTE_DIRECTORY) {
+        attributes |= XP_DIRECTORY;
+    }
+    if (file_attributes & FILE_ATTRIBUTE_READONLY) {
+        attributes |= XP_READONLY;
+    }
+    if (file_attributes & FILE_ATTRIBUTE_NORMAL) {
+        attributes |= XP_NORMAL;
+    }
+    if (file_attributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+        attributes |= XP_LINK;
+    }
+
+    file->bytes = bytes;
+    file->attributes = attributes;
+}
+
+// NOTE: iterator over a directory, the current entry is index in chunk
+typedef struct {
+    uint32_t fields;
+    xp_filter_proc filter;
+    void *user;
+    xp_directory chunk;
+    uint32_t index;
+
+    HANDLE find_handle;
+    WIN32_FIND_DATAA find_data;
+    bool done;
+} xp_iter;
+
+bool xp_iter_open(xp_iter *iter, xp_path path, uint32_t fields, xp_filter_proc filter, void *user) {
+    memset(iter, 0, sizeof(xp_iter));
+    iter->fields = fields;
+    iter->filter = filter;
+    iter->user = user;
+    iter->chunk.fields = fields;
+    iter->find_handle = xp_find_first(&path, &iter->find_data);
+    return iter->find_handle != INVALID_HANDLE_VALUE;
+}
+
+// NOTE: entries are one at a time, the name is only valid until the next call
+bool xp_iter_next(xp_iter *iter, xp_file *file) {
+    while (!iter->done) {
+        WIN32_FIND_DATAA *find_data = &iter->find_data;
+        XP_COUNT(entries_seen, 1);
+        bool wanted = !((iter->fields & XP_SKIP_HIDDEN) && find_data->cFileName[0] == '.');
+        if (wanted && iter->filter) {
+            uint32_t attributes = (find_data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? XP_DIRECTORY : 0;
+            wanted = iter->filter(find_data->cFileName, attributes, iter->user);
+        }
+        if (wanted) {
+            xp_file entry;
+            xp_find_data_file(find_data, iter->fields, &entry);
+            xp_directory_clear(&iter->chunk);
+            iter->index = xp_file_push(&iter->chunk, find_data->cFileName, &entry);
+        }
+        XP_PHASE_BEGIN(enumerate);
+        iter->done = !FindNextFileA(iter->find_handle, find_data);
+        XP_PHASE_END(enumerate);
+        XP_COUNT(dir_reads, 1);
+        if (wanted) {
+            *file = xp_directory_file(&iter->chunk, iter->index);
+            return true;
+        }
+    }
+    return false;
+}
+
+void xp_iter_close(xp_iter *iter) {
+    if (iter->find_handle != INVALID_HANDLE_VALUE) FindClose(iter->find_handle);
+    xp_directory_free(&iter->chunk);
+    memset(iter, 0, sizeof(xp_iter));
+}
+
+// NOTE: the path itself rather than its entries, there are no inodes so XP_FIELD_USAGE leaves them zeroed
+bool xp_path_stat(xp_path path, uint32_t fields, xp_file *file) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    memset(file, 0, sizeof(xp_file));
+    XP_COUNT(stat_calls, 1);
+    if (!GetFileAttributesExA((char *)path.data, GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) file->attributes |= XP_DIRECTORY;
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) file->attributes |= XP_LINK;
+    if (fields & (XP_FIELD_SIZE | XP_FIELD_USAGE)) file->bytes = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    if (fields & XP_FIELD_TIME) file->time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+#elif defined(__linux__)
+// NOTE: size of the buffer handed to getdents64, larger buffers mean fewer syscalls on huge directories
+size_t xp_dirent_buffer_size = XP_DIRENT_BUFFER_SIZE;
+
+struct xp_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t buffer_size;
+    long pos;
+    long end;
+} xp_dirent_reader;
+
+bool xp_dirent_reader_open(xp_dirent_reader *reader, char *path) {
+    memset(reader, 0, sizeof(xp_dirent_reader));
+    reader->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    XP_COUNT(dir_opens, 1);
+    if (reader->fd == -1) {
+        return false;
+    }
+    reader->buffer_size = xp_dirent_buffer_size;
+    if (reader->buffer_size < sizeof(struct xp_dirent64) + 256) {
+        reader->buffer_size = sizeof(struct xp_dirent64) + 256;
+    }
+    reader->buffer = (char *)malloc(reader->buffer_size);
+    XP_COUNT(allocations, 1);
+    return true;
+}
+
+void xp_dirent_reader_close(xp_dirent_reader *reader) {
+    if (reader->fd != -1) close(reader->fd);
+    free(reader->buffer);
+    memset(reader, 0, sizeof(xp_dirent_reader));
+    reader->fd = -1;
+}
+
+// NOTE: reads the next batch of records into the buffer, false at the end of the directory or on error
+bool xp_dirent_fill(xp_dirent_reader *reader) {
+    XP_PHASE_BEGIN(enumerate);
+    long n = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->buffer_size);
+    XP_PHASE_END(enumerate);
+    XP_COUNT(dir_reads, 1);
+    if (n <= 0) {
+        reader->pos = reader->end = 0;
+        return false;
+    }
+    reader->pos = 0;
+    reader->end = n;
+    return true;
+}
+
+// NOTE: returns NULL at the end of the directory or on error, entries are only valid until the next refill
+struct xp_dirent64 *xp_dirent_next(xp_dirent_reader *reader) {
+    if (reader->pos >= reader->end) {
+        if (!xp_dirent_fill(reader)) {
+            return NULL;
+        }
+    }
+    struct xp_dirent64 *entry = (struct xp_dirent64 *)(reader->buffer + reader->pos);
+    reader->pos += entry->d_reclen;
+    return entry;
+}
+
+// NOTE: cleared by whichever stat worker first finds statx missing, so only touched through atomics
+static bool xp_has_statx = true;
+
+unsigned int xp_statx_mask(uint32_t fields) {
+    unsigned int mask = STATX_TYPE;
+    if (fields & XP_FIELD_ATTRIBUTES) mask |= STATX_MODE;
+    if (fields & XP_FIELD_SIZE) mask |= STATX_SIZE;
+    if (fields & XP_FIELD_TIME) mask |= STATX_MTIME;
+    if (fields & XP_FIELD_USAGE) mask |= STATX_MODE | STATX_BLOCKS | STATX_INO | STATX_NLINK;
+    return mask;
+}
+
+int xp_stat_flags(uint32_t fields) {
+    return (fields & XP_FIELD_USAGE) ? AT_SYMLINK_NOFOLLOW : 0;
+}
+
+void xp_file_set_stat(xp_file *file, uint32_t fields, uint32_t mode, uint64_t bytes, uint64_t time) {
+    file->bytes = (fields & XP_FIELD_SIZE) ? bytes : 0;
+    file->time = (fields & XP_FIELD_TIME) ? time : 0;
+    file->attributes = 0;
+    file->attributes |= (S_ISDIR(mode) ? XP_DIRECTORY : 0);
+    file->attributes |= (S_ISREG(mode) ? XP_NORMAL : 0);
+    file->attributes |= ((mode & S_IXUSR) ? XP_EXECUTABLE : 0);
+    file->attributes |= (S_ISLNK(mode) ? XP_LINK : 0);
+}
+
+void xp_file_set_usage(xp_file *file, uint32_t mode, uint64_t blocks, uint64_t inode, uint64_t device, uint64_t links) {
+    file->bytes = blocks * 512;
+    file->inode = inode;
+    file->device = device;
+    if (!S_ISDIR(mode) && links > 1) file->attributes |= XP_HARDLINKED;
+}
+
+void xp_file_set_statx(xp_file *file, uint32_t fields, struct statx *stx) {
+    xp_file_set_stat(file, fields, stx->stx_mode, stx->stx_size, stx->stx_mtime.tv_sec);
+    if (fields & XP_FIELD_USAGE) {
+        xp_file_set_usage(file, stx->stx_mode, stx->stx_blocks, stx->stx_ino,
+            makedev(stx->stx_dev_major, stx->stx_dev_minor), stx->stx_nlink);
+    }
+}
+
+// NOTE: fills in only the requested fields, falls back to fstatat on kernels without statx
+bool xp_stat_at_flags(int dir_fd, char *name, uint32_t fields, int flags, xp_file *file) {
+    if (__atomic_load_n(&xp_has_statx, __ATOMIC_RELAXED)) {
+        struct statx stx;
+        XP_COUNT(stat_calls, 1);
+        if (syscall(SYS_statx, dir_fd, name, flags, xp_statx_mask(fields), &stx) == 0) {
+            xp_file_set_statx(file, fields, &stx);
+            return true;
+        } else if (errno != ENOSYS) {
+            return false;
+        }
+        __atomic_store_n(&xp_has_statx, false, __ATOMIC_RELAXED);
+    }
+    struct stat f_stat;
+    XP_COUNT(stat_calls, 1);
+    if (fstatat(dir_fd, name, &f_stat, flags) != 0) {
+        return false;
+    }
+    xp_file_set_stat(file, fields, f_stat.st_mode, f_stat.st_size, f_stat.st_mtime);
+    if (fields & XP_FIELD_USAGE) {
+        xp_file_set_usage(file, f_stat.st_mode, f_stat.st_blocks, f_stat.st_ino, f_stat.st_dev, f_stat.st_nlink);
+    }
+    return true;
+}
+
+// NOTE: links are followed, a dangling or looping one gets the metadata of the link itself like ls shows it
+bool xp_stat_at(int dir_fd, char *name, uint32_t fields, xp_file *file) {
+    int flags = xp_stat_flags(fields);
+    if (xp_stat_at_flags(dir_fd, name, fields, flags, file)) {
+        return true;
+    }
+    if ((flags & AT_SYMLINK_NOFOLLOW) || (errno != ENOENT && errno != ELOOP)) {
+        return false;
+    }
+    return xp_stat_at_flags(dir_fd, name, fields, flags | AT_SYMLINK_NOFOLLOW, file);
+}
+
+typedef struct {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+} xp_uring;
+
+#define XP_RING_UNTRIED 0
+#define XP_RING_OPEN    1
+#define XP_RING_NONE    2
+
+// NOTE: stat requests for one directory, indices are entries of the directory. The ring is opened by
+// the first batch large enough and reused for every later one until the batch is closed.
+typedef struct xp_stat_batch {
+    int dir_fd;
+    uint32_t fields;
+    xp_directory *directory;
+    int *indices;
+    int count;
+    int next;
+
+    int ring_state;
+    xp_uring ring;
+    struct statx *results;
+
+    // NOTE: pool threads still working on the batch and the link in the pool's list of batches
+    int helpers;
+    struct xp_stat_batch *pool_next;
+} xp_stat_batch;
+
+// NOTE: stat follows links, the link bit comes from the directory listing and is kept
+void xp_stat_batch_store(xp_stat_batch *batch, int index, xp_file *file) {
+    file->attributes |= batch->directory->attributes[index] & XP_LINK;
+    xp_file_store(batch->directory, index, file);
+}
+
+// NOTE: entries the directory listing gave no type for (DT_UNKNOWN on XFS without ftype, many FUSE and
+// NFS mounts) may be links, which only a stat that does not follow them can tell
+bool xp_stat_batch_untyped(xp_stat_batch *batch, int index) {
+    return !(batch->directory->attributes[index] & (XP_DIRECTORY | XP_NORMAL | XP_LINK)) &&
+        !(xp_stat_flags(batch->fields) & AT_SYMLINK_NOFOLLOW);
+}
+
+void xp_stat_batch_entry(xp_stat_batch *batch, int index) {
+    xp_file file = {0};
+    file.attributes = batch->directory->attributes[index];
+    char *name = xp_file_name(batch->directory, index);
+    if (xp_stat_batch_untyped(batch, index)) {
+        if (!xp_stat_at_flags(batch->dir_fd, name, batch->fields, AT_SYMLINK_NOFOLLOW, &file)) {
+            return;
+        }
+        if (file.attributes & XP_LINK) {
+            xp_stat_at(batch->dir_fd, name, batch->fields, &file);
+            file.attributes |= XP_LINK;
+        }
+        xp_stat_batch_store(batch, index, &file);
+    } else if (xp_stat_at(batch->dir_fd, name, batch->fields, &file)) {
+        xp_stat_batch_store(batch, index, &file);
+    }
+}
+
+void xp_stat_batch_serial(xp_stat_batch *batch, int start) {
+    for (int i = start; i < batch->count; i++) {
+        xp_stat_batch_entry(batch, batch->indices[i]);
+    }
+}
+
+bool xp_uring_open(xp_uring *ring, unsigned int depth) {
+    memset(ring, 0, sizeof(xp_uring));
+    struct io_uring_params params = {0};
+    ring->fd = (int)syscall(SYS_io_uring_setup, depth, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    char *sq = (char *)ring->sq_ptr;
+    char *cq = (char *)ring->cq_ptr;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void xp_uring_close(xp_uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// NOTE: shared across batches and workers like xp_has_statx
+static bool xp_has_uring = true;
+
+// NOTE: stores every completion waiting in the ring and hands its slot back, returns how many there were
+int xp_stat_batch_reap(xp_stat_batch *batch, int *slot_file, int *free_slots, int *free_count) {
+    xp_uring *ring = &batch->ring;
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int slot = (int)cqe->user_data;
+        // NOTE: an untyped entry was stat'd without following, a link among them is followed serially
+        bool link = cqe->res == 0 && S_ISLNK(batch->results[slot].stx_mode);
+        if (cqe->res == 0 && !(link && xp_stat_batch_untyped(batch, slot_file[slot]))) {
+            xp_file file = {0};
+            xp_file_set_statx(&file, batch->fields, &batch->results[slot]);
+            xp_stat_batch_store(batch, slot_file[slot], &file);
+        } else {
+            xp_stat_batch_entry(batch, slot_file[slot]);
+        }
+        free_slots[(*free_count)++] = slot;
+        reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// NOTE: once a ring fails it is not tried again, the process falls back to the thread pool for good
+void xp_stat_batch_ring_close(xp_stat_batch *batch, bool failed) {
+    if (batch->ring_state == XP_RING_OPEN) {
+        xp_uring_close(&batch->ring);
+        free(batch->results);
+        batch->results = NULL;
+    }
+    batch->ring_state = XP_RING_NONE;
+    if (failed) __atomic_store_n(&xp_has_uring, false, __ATOMIC_RELAXED);
+}
+
+// NOTE: keeps up to XP_STAT_URING_DEPTH statx requests in flight, anything the ring rejects is retried serially.
+// If the ring itself fails, everything the kernel took is reaped before returning and the rest of the
+// batch from next on is left to the caller.
+bool xp_stat_batch_uring(xp_stat_batch *batch) {
+    if (batch->ring_state == XP_RING_UNTRIED) {
+        batch->ring_state = XP_RING_NONE;
+        if (__atomic_load_n(&xp_has_uring, __ATOMIC_RELAXED) && xp_uring_open(&batch->ring, XP_STAT_URING_DEPTH)) {
+            batch->results = (struct statx *)malloc(XP_STAT_URING_DEPTH * sizeof(struct statx));
+            batch->ring_state = XP_RING_OPEN;
+        } else {
+            __atomic_store_n(&xp_has_uring, false, __ATOMIC_RELAXED);
+        }
+    }
+    if (batch->ring_state != XP_RING_OPEN) {
+        return false;
+    }
+
+    xp_uring *ring = &batch->ring;
+    int slot_file[XP_STAT_URING_DEPTH];
+    int free_slots[XP_STAT_URING_DEPTH];
+    int free_count = XP_STAT_URING_DEPTH;
+    for (int i = 0; i < XP_STAT_URING_DEPTH; i++) free_slots[i] = i;
+
+    unsigned int mask = xp_statx_mask(batch->fields);
+    int flags = xp_stat_flags(batch->fields);
+    // NOTE: queued are in the submission queue but not yet taken by the kernel, in_flight were taken
+    int queued = 0;
+    int in_flight = 0;
+    bool failed = false;
+    while (batch->next < batch->count || queued > 0 || in_flight > 0) {
+        unsigned int tail = *ring->sq_tail;
+        int added = 0;
+        while (batch->next < batch->count && free_count > 0) {
+            int slot = free_slots[--free_count];
+            int file_index = batch->indices[batch->next++];
+            slot_file[slot] = file_index;
+
+            unsigned int index = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = batch->dir_fd;
+            sqe->addr = (uint64_t)(uintptr_t)xp_file_name(batch->directory, file_index);
+            sqe->len = mask;
+            sqe->statx_flags = xp_stat_batch_untyped(batch, file_index) ? flags | AT_SYMLINK_NOFOLLOW : flags;
+            sqe->off = (uint64_t)(uintptr_t)&batch->results[slot];
+            sqe->user_data = slot;
+            ring->sq_array[index] = index;
+            tail++;
+            added++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        queued += added;
+        XP_COUNT(uring_calls, 1);
+        XP_COUNT(uring_stats, added);
+
+        long submitted = syscall(SYS_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno != EINTR) {
+            failed = true;
+            break;
+        }
+        if (submitted > 0) {
+            queued -= (int)submitted;
+            in_flight += (int)submitted;
+        }
+        in_flight -= xp_stat_batch_reap(batch, slot_file, free_slots, &free_count);
+    }
+    if (!failed) {
+        return true;
+    }
+
+    // NOTE: the kernel writes into results until the requests it took complete, so those are waited for
+    while (in_flight > 0) {
+        if (syscall(SYS_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;
+        }
+        in_flight -= xp_stat_batch_reap(batch, slot_file, free_slots, &free_count);
+    }
+    if (in_flight > 0) {
+        // NOTE: requests that never completed may still write into the buffer, so it is given up rather than freed
+        batch->results = NULL;
+    }
+
+    // NOTE: slots not handed back were never submitted or never completed
+    bool done[XP_STAT_URING_DEPTH] = {0};
+    for (int i = 0; i < free_count; i++) done[free_slots[i]] = true;
+    for (int slot = 0; slot < XP_STAT_URING_DEPTH; slot++) {
+        if (!done[slot]) xp_stat_batch_entry(batch, slot_file[slot]);
+    }
+    xp_stat_batch_ring_close(batch, true);
+    return false;
+}
+
+void xp_stat_batch_worker(xp_stat_batch *batch) {
+    for (;;) {
+        int start = __atomic_fetch_add(&batch->next, 32, __ATOMIC_RELAXED);
+        if (start >= batch->count) break;
+        int end = (start + 32 < batch->count) ? start + 32 : batch->count;
+        for (int i = start; i < end; i++) {
+            xp_stat_batch_entry(batch, batch->indices[i]);
+        }
+    }
+}
+
+// NOTE: one pool for the whole process, started by the first batch that needs it. Batches wait in a list
+// and the pool threads join whichever still has entries left, next to the thread that queued it.
+typedef struct {
+    xt_mutex mutex;
+    xt_cond work;
+    xt_cond done;
+    xp_stat_batch *batches;
+    int thread_count;
+} xp_stat_pool;
+
+static xp_stat_pool xp_pool;
+static pthread_once_t xp_pool_once = PTHREAD_ONCE_INIT;
+
+XT_PROC(xp_stat_pool_thread) {
+    (void)data;
+    xt_mutex_lock(&xp_pool.mutex);
+    for (;;) {
+        xp_stat_batch *batch = xp_pool.batches;
+        while (batch && __atomic_load_n(&batch->next, __ATOMIC_RELAXED) >= batch->count) {
+            batch = batch->pool_next;
+        }
+        if (!batch) {
+            xt_cond_wait(&xp_pool.work, &xp_pool.mutex);
+            continue;
+        }
+        batch->helpers++;
+        xt_mutex_unlock(&xp_pool.mutex);
+        xp_stat_batch_worker(batch);
+        xt_mutex_lock(&xp_pool.mutex);
+        if (--batch->helpers == 0) xt_cond_broadcast(&xp_pool.done);
+    }
+    XT_PROC_RETURN;
+}
+
+// NOTE: stat mostly waits on the disk or the network, so the pool has more threads than cores
+void xp_stat_pool_start(void) {
+    xt_mutex_init(&xp_pool.mutex);
+    xt_cond_init(&xp_pool.work);
+    xt_cond_init(&xp_pool.done);
+    int threads = 2 * xt_cpu_count();
+    if (threads > XP_STAT_THREADS) threads = XP_STAT_THREADS;
+    for (int i = 0; i < threads; i++) {
+        xt_thread thread;
+        if (xt_thread_create(&thread, xp_stat_pool_thread, NULL)) {
+            pthread_detach(thread);
+            xp_pool.thread_count++;
+        }
+    }
+}
+
+void xp_stat_batch_threads(xp_stat_batch *batch) {
+    pthread_once(&xp_pool_once, xp_stat_pool_start);
+    // NOTE: the calling thread helps out, and finishes the batch alone if no thread could be started
+    if (xp_pool.thread_count == 0) {
+        xp_stat_batch_worker(batch);
+        return;
+    }
+
+    xt_mutex_lock(&xp_pool.mutex);
+    batch->helpers = 0;
+    batch->pool_next = xp_pool.batches;
+    xp_pool.batches = batch;
+    xt_cond_broadcast(&xp_pool.work);
+    xt_mutex_unlock(&xp_pool.mutex);
+
+    xp_stat_batch_worker(batch);
+
+    xt_mutex_lock(&xp_pool.mutex);
+    xp_stat_batch **link = &xp_pool.batches;
+    while (*link != batch) link = &(*link)->pool_next;
+    *link = batch->pool_next;
+    while (batch->helpers > 0) {
+        xt_cond_wait(&xp_pool.done, &xp_pool.mutex);
+    }
+    xt_mutex_unlock(&xp_pool.mutex);
+}
+
+// NOTE: high latency mounts spend all their time waiting on stat, so large batches go through io_uring
+// and fall back to a thread pool on kernels without it
+void xp_stat_batch_run(xp_stat_batch *batch) {
+    XP_PHASE_BEGIN(stat);
+    if (batch->count < XP_STAT_BATCH_MIN) {
+        xp_stat_batch_serial(batch, 0);
+    } else if (!xp_stat_batch_uring(batch)) {
+        xp_stat_batch_threads(batch);
+    }
+    XP_PHASE_END(stat);
+}
+
+void xp_stat_batch_close(xp_stat_batch *batch) {
+    xp_stat_batch_ring_close(batch, false);
+    free(batch->indices);
+}
+
+// NOTE: d_type answers everything about directories, regular files still need the mode for the executable bit
+bool xp_dirent_needs_stat(struct xp_dirent64 *entry, uint32_t fields) {
+    if (fields & (XP_FIELD_SIZE | XP_FIELD_TIME | XP_FIELD_USAGE)) return true;
+    if (fields & XP_FIELD_ATTRIBUTES) return entry->d_type != DT_DIR;
+    if (fields & XP_FIELD_TYPE) return entry->d_type == DT_UNKNOWN;
+    return false;
+}
+
+// NOTE: iterator over a directory, entries come one getdents buffer at a time in chunk, whose
+// names point straight into that buffer. The current entry is index in chunk.
+typedef struct {
+    uint32_t fields;
+    xp_filter_proc filter;
+    void *user;
+    xp_directory chunk;
+    uint32_t index;
+
+    xp_dirent_reader reader;
+    xp_stat_batch batch;
+    int pending_cap;
+    uint32_t next;
+} xp_iter;
+
+bool xp_iter_open(xp_iter *iter, xp_path path, uint32_t fields, xp_filter_proc filter, void *user) {
+    memset(iter, 0, sizeof(xp_iter));
+    iter->fields = fields;
+    iter->filter = filter;
+    iter->user = user;
+
+    xp_normalize(&path);
+    if (!xp_dirent_reader_open(&iter->reader, (char *)path.data)) {
+        return false;
+    }
+    iter->chunk.fields = fields;
+    iter->batch.dir_fd = iter->reader.fd;
+    iter->batch.fields = fields;
+    iter->batch.directory = &iter->chunk;
+    return true;
+}
+
+// NOTE: runs the filter over the next getdents buffer and stats what is left as one batch
+bool xp_iter_fill(xp_iter *iter) {
+    if (!xp_dirent_fill(&iter->reader)) {
+        return false;
+    }
+    xp_dirent_reader *reader = &iter->reader;
+    xp_stat_batch *batch = &iter->batch;
+    xp_directory_clear(&iter->chunk);
+    iter->chunk.names.data = reader->buffer;
+    iter->next = 0;
+    batch->count = 0;
+    batch->next = 0;
+
+    uint32_t seen = 0;
+    for (long pos = reader->pos; pos < reader->end;) {
+        struct xp_dirent64 *dir = (struct xp_dirent64 *)(reader->buffer + pos);
+        pos += dir->d_reclen;
+        seen++;
+
+        if ((iter->fields & XP_SKIP_HIDDEN) && dir->d_name[0] == '.') {
+            continue;
+        }
+
+        xp_file file = {0};
+        if (dir->d_type == DT_DIR) file.attributes |= XP_DIRECTORY;
+        if (dir->d_type == DT_REG) file.attributes |= XP_NORMAL;
+        if (dir->d_type == DT_LNK) file.attributes |= XP_LINK;
+        if (iter->filter && !iter->filter(dir->d_name, file.attributes, iter->user)) {
+            continue;
+        }
+
+        if (xp_dirent_needs_stat(dir, iter->fields)) {
+            if (batch->count == iter->pending_cap) {
+                iter->pending_cap = iter->pending_cap ? iter->pending_cap * 2 : 256;
+                batch->indices = (int *)realloc(batch->indices, iter->pending_cap * sizeof(int));
+                XP_COUNT(allocations, 1);
+            }
+            batch->indices[batch->count++] = iter->chunk.file_count;
+        }
+        xp_file_push_at(&iter->chunk, (uint32_t)(dir->d_name - reader->buffer), &file);
+    }
+    XP_COUNT(entries_seen, seen);
+
+    xp_stat_batch_run(batch);
+    return true;
+}
+
+// NOTE: the name points into the kernel dirent buffer and is only valid until the buffer is refilled
+bool xp_iter_next(xp_iter *iter, xp_file *file) {
+    while (iter->next >= (uint32_t)iter->chunk.file_count) {
+        if (!xp_iter_fill(iter)) {
+            return false;
+        }
+    }
+    iter->index = iter->next++;
+    *file = xp_directory_file(&iter->chunk, iter->index);
+    return true;
+}
+
+void xp_iter_close(xp_iter *iter) {
+    // NOTE: the names belong to the reader
+    memset(&iter->chunk.names, 0, sizeof(xp_arena));
+    xp_directory_free(&iter->chunk);
+    xp_stat_batch_close(&iter->batch);
+    xp_dirent_reader_close(&iter->reader);
+    memset(iter, 0, sizeof(xp_iter));
+}
+
+// NOTE: the path itself rather than its entries
+bool xp_path_stat(xp_path path, uint32_t fields, xp_file *file) {
+    memset(file, 0, sizeof(xp_file));
+    xp_normalize(&path);
+    return xp_stat_at(AT_FDCWD, (char *)path.data, fields, file);
+}
+
+// NOTE: identifies one state of a directory, any entry added, removed or renamed changes the times
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+} xp_dir_stamp;
+
+bool xp_directory_stamp(xp_path path, xp_dir_stamp *stamp) {
+    struct stat f_stat;
+    memset(stamp, 0, sizeof(xp_dir_stamp));
+    xp_normalize(&path);
+    XP_COUNT(stat_calls, 1);
+    if (stat((char *)path.data, &f_stat) != 0 || !S_ISDIR(f_stat.st_mode)) {
+        return false;
+    }
+    stamp->device = f_stat.st_dev;
+    stamp->inode = f_stat.st_ino;
+    stamp->mtime_sec = f_stat.st_mtim.tv_sec;
+    stamp->mtime_nsec = f_stat.st_mtim.tv_nsec;
+    stamp->ctime_sec = f_stat.st_ctim.tv_sec;
+    stamp->ctime_nsec = f_stat.st_ctim.tv_nsec;
+    return true;
+}
+
+#define XP_CACHE_MAGIC   0x5453494c // "LIST"
+#define XP_CACHE_VERSION 2
+
+// NOTE: a saved listing is this header, the directory path, then the columns widest first so
+// every column is aligned, then the names. key is whatever the caller wants the listing tied to.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    xp_dir_stamp stamp;
+    uint64_t file_size;
+    uint64_t names_size;
+    uint32_t file_count;
+    uint32_t path_length;
+} xp_cache_header;
+
+#define XP_ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct {
+    size_t path;
+    size_t sizes;
+    size_t times;
+    size_t name_offsets;
+    size_t attributes;
+    size_t order;
+    size_t name_lengths;
+    size_t ext_offsets;
+    size_t widths;
+    size_t name_flags;
+    size_t names;
+    size_t end;
+} xp_cache_layout;
+
+xp_cache_layout xp_cache_layout_of(uint32_t count, uint32_t path_length, uint64_t names_size) {
+    xp_cache_layout layout;
+    layout.path = sizeof(xp_cache_header);
+    layout.sizes = XP_ALIGN8(layout.path + path_length + 1);
+    layout.times = layout.sizes + count * sizeof(uint64_t);
+    layout.name_offsets = layout.times + count * sizeof(uint64_t);
+    layout.attributes = layout.name_offsets + count * sizeof(uint32_t);
+    layout.order = layout.attributes + count * sizeof(uint32_t);
+    layout.name_lengths = layout.order + count * sizeof(uint32_t);
+    layout.ext_offsets = layout.name_lengths + count * sizeof(uint16_t);
+    layout.widths = layout.ext_offsets + count * sizeof(uint16_t);
+    layout.name_flags = layout.widths + count * sizeof(uint16_t);
+    layout.names = layout.name_flags + count * sizeof(uint8_t);
+    layout.end = layout.names + names_size;
+    return layout;
+}
+
+// NOTE: writes the entries in order (not the whole directory) to a temporary file next to file_name
+// and renames it over, so readers only ever map a complete listing
+bool xp_directory_save(const xp_directory *directory, char *file_name, xp_dir_stamp *stamp, uint64_t key) {
+    uint32_t count = (uint32_t)directory->order_count;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        names_size += directory->name_lengths[directory->order[i]] + 1;
+    }
+    xp_cache_layout layout = xp_cache_layout_of(count, directory->path.count, names_size);
+
+    char *image = (char *)calloc(1, layout.end);
+    if (!image) {
+        return false;
+    }
+    xp_cache_header *header = (xp_cache_header *)image;
+    header->magic = XP_CACHE_MAGIC;
+    header->version = XP_CACHE_VERSION;
+    header->key = key;
+    header->stamp = *stamp;
+    header->file_size = layout.end;
+    header->names_size = names_size;
+    header->file_count = count;
+    header->path_length = directory->path.count;
+    memcpy(image + layout.path, directory->path.data, directory->path.count);
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = directory->order[i];
+        int length = directory->name_lengths[index];
+        ((uint64_t *)(image + layout.sizes))[i] = directory->sizes[index];
+        ((uint64_t *)(image + layout.times))[i] = directory->times[index];
+        ((uint32_t *)(image + layout.name_offsets))[i] = offset;
+        ((uint32_t *)(image + layout.attributes))[i] = directory->attributes[index];
+        ((uint32_t *)(image + layout.order))[i] = i;
+        ((uint16_t *)(image + layout.name_lengths))[i] = (uint16_t)length;
+        ((uint16_t *)(image + layout.ext_offsets))[i] = directory->ext_offsets[index];
+        ((uint16_t *)(image + layout.widths))[i] = directory->widths[index];
+        ((uint8_t *)(image + layout.name_flags))[i] = directory->name_flags[index];
+        memcpy(image + layout.names + offset, xp_file_name(directory, index), length + 1);
+        offset += length + 1;
+    }
+
+    size_t name_length = strlen(file_name);
+    char *temp_name = (char *)malloc(name_length + 8);
+    memcpy(temp_name, file_name, name_length);
+    strcpy(temp_name + name_length, ".XXXXXX");
+    int fd = mkstemp(temp_name);
+    bool saved = fd != -1;
+    for (size_t written = 0; saved && written < layout.end;) {
+        ssize_t n = write(fd, image + written, layout.end - written);
+        if (n < 0 && errno == EINTR) continue;
+        saved = n > 0;
+        if (saved) written += n;
+    }
+    if (fd != -1) {
+        saved = (close(fd) == 0) && saved;
+        saved = saved && rename(temp_name, file_name) == 0;
+        if (!saved) unlink(temp_name);
+    }
+    free(temp_name);
+    free(image);
+    return saved;
+}
+
+// NOTE: maps a saved listing and points the columns straight into it, false unless it was saved
+// with the same key for the same path and the directory still has the same stamp
+bool xp_directory_map(xp_directory *directory, char *file_name, xp_path path, xp_dir_stamp *stamp, uint64_t key) {
+    memset(directory, 0, sizeof(xp_directory));
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat f_stat;
+    if (fstat(fd, &f_stat) != 0 || (size_t)f_stat.st_size < sizeof(xp_cache_header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)f_stat.st_size;
+    char *image = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return false;
+    }
+
+    xp_cache_header *header = (xp_cache_header *)image;
+    bool valid = header->magic == XP_CACHE_MAGIC && header->version == XP_CACHE_VERSION && header->key == key;
+    valid = valid && memcmp(&header->stamp, stamp, sizeof(xp_dir_stamp)) == 0;
+    valid = valid && header->file_size == size && header->path_length == (uint32_t)path.count;
+    valid = valid && memcmp(image + sizeof(xp_cache_header), path.data, path.count) == 0;
+    xp_cache_layout layout = {0};
+    if (valid) {
+        valid = header->names_size <= size;
+        layout = xp_cache_layout_of(header->file_count, header->path_length, header->names_size);
+        valid = valid && layout.end == size;
+    }
+
+    // NOTE: a damaged file must not lead anywhere outside the mapping, every order entry has to be
+    // a file and every name has to end inside the names, like snapshot_load checks them
+    uint32_t *order = (uint32_t *)(image + layout.order);
+    uint32_t *name_offsets = (uint32_t *)(image + layout.name_offsets);
+    uint16_t *name_lengths = (uint16_t *)(image + layout.name_lengths);
+    uint16_t *ext_offsets = (uint16_t *)(image + layout.ext_offsets);
+    char *names = image + layout.names;
+    for (uint32_t i = 0; valid && i < header->file_count; i++) {
+        uint64_t end = (uint64_t)name_offsets[i] + name_lengths[i];
+        valid = order[i] < header->file_count && end < header->names_size && names[end] == '\0' && ext_offsets[i] <= name_lengths[i];
+    }
+    if (!valid) {
+        munmap(image, size);
+        return false;
+    }
+
+    directory->path = xp_path_copy(path);
+    directory->file_count = directory->file_cap = directory->order_count = (int)header->file_count;
+    directory->sizes = (uint64_t *)(image + layout.sizes);
+    directory->times = (uint64_t *)(image + layout.times);
+    directory->name_offsets = (uint32_t *)(image + layout.name_offsets);
+    directory->attributes = (uint32_t *)(image + layout.attributes);
+    directory->order = (uint32_t *)(image + layout.order);
+    directory->name_lengths = (uint16_t *)(image + layout.name_lengths);
+    directory->ext_offsets = (uint16_t *)(image + layout.ext_offsets);
+    directory->widths = (uint16_t *)(image + layout.widths);
+    directory->name_flags = (uint8_t *)(image + layout.name_flags);
+    directory->names.data = image + layout.names;
+    directory->names.used = directory->names.size = header->names_size;
+    directory->mapping = image;
+    directory->mapping_size = size;
+    return true;
+}
+#endif
+
+// NOTE: filter sees each name before it is copied or stat'd, entries it rejects cost nothing more
+bool xp_directory_scan_filtered(xp_path path, xp_directory *directory, uint32_t fields, xp_filter_proc filter, void *user) {
+    memset(directory, 0, sizeof(xp_directory));
+    xp_normalize(&path);
+    directory->path = xp_fullpath(path);
+    directory->fields = fields;
+
+    xp_iter iter;
+    if (!xp_iter_open(&iter, path, fields, filter, user)) {
+        xp_iter_close(&iter);
+        return false;
+    }
+    xp_file file;
+    while (xp_iter_next(&iter, &file)) {
+        xp_file_copy(directory, &iter.chunk, iter.index);
+    }
+    xp_iter_close(&iter);
+    xp_directory_reset_order(directory);
+    return true;
+}
+
+bool xp_directory_scan(xp_path path, xp_directory *directory, uint32_t fields) {
+    return xp_directory_scan_filtered(path, directory, fields, NULL, NULL);
+}
+
+// NOTE: hands every entry that gets past filter to proc without building the whole directory
+bool xp_directory_visit(xp_path path, uint32_t fields, xp_filter_proc filter, void *filter_user, xp_visit_proc proc, void *user) {
+    xp_iter iter;
+    if (!xp_iter_open(&iter, path, fields, filter, filter_user)) {
+        xp_iter_close(&iter);
+        return false;
+    }
+    xp_file file;
+    while (xp_iter_next(&iter, &file)) {
+        if (!proc(&iter.chunk, iter.index, user)) break;
+    }
+    xp_iter_close(&iter);
+    return true;
+}
+
+bool xp_directory_new(xp_path path, xp_directory *directory) {
+    return xp_directory_scan(path, directory, XP_FIELD_ALL);
+}
+
+void xp_path_append(xp_path *path, char *str) {
+    char *ptr = (char *)malloc(path->count + 1 + strlen(str) + 1);
+    strncpy(ptr, (char *)path->data, path->count);
+    strcat(ptr, "/");
+    strcat(ptr, str);
+
+    free(path->data);
+    path->data = (unsigned char *)ptr;
+    path->count = (int)strlen(ptr);
+}
+
+#if defined(_WIN32)
+// NOTE: seconds since 1970 of a FILETIME
+int64_t xp_unix_time(uint64_t time) {
+    return (int64_t)(time / 10000000ull) - 11644473600ll;
+}
+
+// NOTE: local calendar time of seconds since 1970, and the offset from UTC in seconds at that time
+bool xp_local_time(int64_t time, xp_time *local, int64_t *offset) {
+    uint64_t file_time = (uint64_t)(time + 11644473600ll) * 10000000ull;
+    FILETIME ft = {(DWORD)file_time, (DWORD)(file_time >> 32)};
+    FILETIME local_ft = {0};
+    SYSTEMTIME systime = {0};
+    if (!FileTimeToLocalFileTime(&ft, &local_ft) || !FileTimeToSystemTime(&local_ft, &systime)) {
+        return false;
+    }
+    memset(local, 0, sizeof(xp_time));
+    local->year = systime.wYear;
+    local->month = systime.wMonth;
+    local->day = systime.wDay;
+    local->hour = systime.wHour;
+    local->minute = systime.wMinute;
+    local->second = systime.wSecond;
+    uint64_t local_time = ((uint64_t)local_ft.dwHighDateTime << 32) | local_ft.dwLowDateTime;
+    *offset = (int64_t)(local_time / 10000000ull) - (int64_t)(file_time / 10000000ull);
+    return true;
+}
+#elif defined(__linux__)
+int64_t xp_unix_time(uint64_t time) {
+    return (int64_t)time;
+}
+
+// NOTE: local calendar time of seconds since 1970, and the offset from UTC in seconds at that time
+bool xp_local_time(int64_t time, xp_time *local, int64_t *offset) {
+    time_t time_ = (time_t)time;
+    struct tm local_time;
+    if (!localtime_r(&time_, &local_time)) {
+        return false;
+    }
+    memset(local, 0, sizeof(xp_time));
+    local->year = local_time.tm_year + 1900;
+    local->month = local_time.tm_mon + 1;
+    local->day = local_time.tm_mday;
+    local->hour = local_time.tm_hour;
+    local->minute = local_time.tm_min;
+    local->second = local_time.tm_sec;
+    *offset = local_time.tm_gmtoff;
+    return true;
+}
+#endif
+
+#endif // XPATH_H
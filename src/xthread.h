@@ -0,0 +1,91 @@
+#ifndef XTHREAD_H
+#define XTHREAD_H
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <stdbool.h>
+
+#ifdef _WIN32
+typedef HANDLE xt_thread;
+typedef CRITICAL_SECTION xt_mutex;
+typedef CONDITION_VARIABLE xt_cond;
+
+// NOTE: declares a thread entry point, the argument is named data
+#define XT_PROC(name) DWORD WINAPI name(LPVOID data)
+#define XT_PROC_RETURN return 0
+typedef LPTHREAD_START_ROUTINE xt_proc;
+#define XT_THREAD_LOCAL __declspec(thread)
+#elif defined(__linux__)
+typedef pthread_t xt_thread;
+typedef pthread_mutex_t xt_mutex;
+typedef pthread_cond_t xt_cond;
+
+// NOTE: declares a thread entry point, the argument is named data
+#define XT_PROC(name) void *name(void *data)
+#define XT_PROC_RETURN return NULL
+typedef void *(*xt_proc)(void *);
+#define XT_THREAD_LOCAL __thread
+#endif
+
+#ifdef _WIN32
+bool xt_thread_create(xt_thread *thread, xt_proc proc, void *data) {
+    *thread = CreateThread(NULL, 0, proc, data, 0, NULL);
+    return *thread != NULL;
+}
+
+void xt_thread_join(xt_thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void xt_mutex_init(xt_mutex *mutex) { InitializeCriticalSection(mutex); }
+void xt_mutex_destroy(xt_mutex *mutex) { DeleteCriticalSection(mutex); }
+void xt_mutex_lock(xt_mutex *mutex) { EnterCriticalSection(mutex); }
+void xt_mutex_unlock(xt_mutex *mutex) { LeaveCriticalSection(mutex); }
+
+void xt_cond_init(xt_cond *cond) { InitializeConditionVariable(cond); }
+void xt_cond_destroy(xt_cond *cond) { }
+void xt_cond_wait(xt_cond *cond, xt_mutex *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void xt_cond_signal(xt_cond *cond) { WakeConditionVariable(cond); }
+void xt_cond_broadcast(xt_cond *cond) { WakeAllConditionVariable(cond); }
+
+int xt_cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#elif defined(__linux__)
+bool xt_thread_create(xt_thread *thread, xt_proc proc, void *data) {
+    return pthread_create(thread, NULL, proc, data) == 0;
+}
+
+void xt_thread_join(xt_thread thread) {
+    pthread_join(thread, NULL);
+}
+
+void xt_mutex_init(xt_mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+void xt_mutex_destroy(xt_mutex *mutex) { pthread_mutex_destroy(mutex); }
+void xt_mutex_lock(xt_mutex *mutex) { pthread_mutex_lock(mutex); }
+void xt_mutex_unlock(xt_mutex *mutex) { pthread_mutex_unlock(mutex); }
+
+void xt_cond_init(xt_cond *cond) { pthread_cond_init(cond, NULL); }
+void xt_cond_destroy(xt_cond *cond) { pthread_cond_destroy(cond); }
+void xt_cond_wait(xt_cond *cond, xt_mutex *mutex) { pthread_cond_wait(cond, mutex); }
+void xt_cond_signal(xt_cond *cond) { pthread_cond_signal(cond); }
+void xt_cond_broadcast(xt_cond *cond) { pthread_cond_broadcast(cond); }
+
+int xt_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+#endif
+
+#endif // XTHREAD_H